@@ -3,10 +3,17 @@
 //===----------------------------------------------------------------------------------===//
 
 #include <memory>
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/NoFolder.h"
+#include "llvm/Support/Debug.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 #include "llvm/Transforms/Obfuscation/Morphling.h"
 #include "llvm/Transforms/Obfuscation/BogusControlFlow.h"
 
@@ -21,89 +28,143 @@ bcf_rate("mh_bcf_rate",
          cl::value_desc("don't tell you"), cl::init(100),
          cl::Optional);
 
+static cl::opt<int>
+bcf_traps("mh_bcf_traps",
+          cl::desc("unreachable blocks shared by the bogus edges of a function"),
+          cl::value_desc("mh_bcf_traps"), cl::init(2),
+          cl::Optional);
+
 namespace {
   
+  /* mh_bcf_* with obfuscation.bcfobf applied, read once per process */
+  struct BCFOptions {
+    int rate;
+    int traps;
+  };
+  
+  const BCFOptions &bcfOptions() {
+    static const BCFOptions options = [] {
+      BCFOptions options = {bcf_rate, bcf_traps};
+      rp::Value config = Morphling::getConfig("obfuscation.bcfobf");
+      if (config.HasMember("bcf_rate"))
+        options.rate = config.FindMember("bcf_rate")->value.GetInt();
+      if (config.HasMember("bcf_traps"))
+        options.traps = config.FindMember("bcf_traps")->value.GetInt();
+      return options;
+    }();
+    return options;
+  }
+  
+  struct BogusControlFlow;
+  
+  /* always false; cost is what the real path pays, in instructions */
+  struct Predicate {
+    unsigned cost;
+    Value *(*build)(BogusControlFlow *pass, IRBuilder<> &irb);
+  };
+  
+  Value *predGlobal(BogusControlFlow *pass, IRBuilder<> &irb);
+  Value *predEven(BogusControlFlow *pass, IRBuilder<> &irb);
+  Value *predSquare(BogusControlFlow *pass, IRBuilder<> &irb);
+  
+  const Predicate predBox[] = {
+    {1, predGlobal},
+    {4, predEven},
+    {5, predSquare},
+  };
+  
+  typedef void (*Route)(BogusControlFlow *pass, Function &F, BasicBlock *basicBlock);
+  
+  void routeSelfLoop(BogusControlFlow *pass, Function &F, BasicBlock *basicBlock);
+  void routeTrap(BogusControlFlow *pass, Function &F, BasicBlock *basicBlock);
+  
+  const Route routeBox[] = {
+    routeSelfLoop,
+    routeTrap,
+  };
+  
   struct BogusControlFlow : public FunctionPass {
     static char ID;
     bool flag;
     
-    vector<function<void(Function &F, BasicBlock *basicBlock, vector<BasicBlock *> &pads)>> routeBox;
+    CryptoUtils crypto;
     
-    BogusControlFlow() : FunctionPass(ID) {this->flag = true, initBox();}
-    BogusControlFlow(bool flag) : FunctionPass(ID) {this->flag = flag, initBox();}
+    /* per function: loop nesting and integer values live in every block */
+    LoopInfo *loops;
+    vector<Value *> lives;
+    vector<BasicBlock *> traps;
     
-    void initBox() {
-      routeBox = {
-        
-        /* slight1 */
-        [](Function &F, BasicBlock *basicBlock, vector<BasicBlock *> &pads){
-          BasicBlock::iterator ii = basicBlock->begin();
-          if (basicBlock->getFirstNonPHIOrDbgOrLifetime())
-            ii = (BasicBlock::iterator)basicBlock->getFirstNonPHIOrDbgOrLifetime();
-          
-          BasicBlock *original = basicBlock->splitBasicBlock(ii, "original");
-          basicBlock->getTerminator()->eraseFromParent();
-          
-          int ibase = (int)llvm::cryptoutils->get_range(INT16_MAX);
-          int iadd = (int)llvm::cryptoutils->get_range(INT8_MAX);
-          
-          Value *var1 = ConstantInt::get(Type::getInt32Ty(F.getContext()), ibase, false);
-          Value *var2 = ConstantInt::get(Type::getInt32Ty(F.getContext()), ibase+iadd+1, false);
-          
-          ICmpInst * condition = new ICmpInst(*basicBlock, ICmpInst::ICMP_EQ, var1, var2);
-          BranchInst::Create(basicBlock, original, (Value*)condition, basicBlock)->setBogusBranch(true);
-        },
-        
-        /* slight2 */
-        [](Function &F, BasicBlock *basicBlock, vector<BasicBlock *> &pads){
-          BasicBlock::iterator ii = basicBlock->begin();
-          if (basicBlock->getFirstNonPHIOrDbgOrLifetime())
-            ii = (BasicBlock::iterator)basicBlock->getFirstNonPHIOrDbgOrLifetime();
-          
-          BasicBlock *original = basicBlock->splitBasicBlock(ii, "original");
-          basicBlock->getTerminator()->eraseFromParent();
-          
-          BasicBlock *puzzleJmp = BasicBlock::Create(F.getContext(), "puzzleJmp", &F);
-          new UnreachableInst(F.getContext(), puzzleJmp);
-          
-          int ibase = (int)llvm::cryptoutils->get_range(INT16_MAX);
-          int iadd = (int)llvm::cryptoutils->get_range(INT8_MAX);
-          
-          Value *var1 = ConstantInt::get(Type::getInt32Ty(F.getContext()), ibase, false);
-          Value *var2 = ConstantInt::get(Type::getInt32Ty(F.getContext()), ibase+iadd+1, false);
-          
-          ICmpInst * condition = new ICmpInst(*basicBlock, ICmpInst::ICMP_EQ, var1, var2);
-          BranchInst::Create(puzzleJmp, original, (Value*)condition, basicBlock)->setBogusBranch(true);;
-        },
-        
-        /* ultimate1 */
-        /*
-         [](Function &F, BasicBlock *basicBlock, vector<BasicBlock *> &pads){
-         BasicBlock::iterator ii = basicBlock->begin();
-         if (basicBlock->getFirstNonPHIOrDbgOrLifetime())
-         ii = (BasicBlock::iterator)basicBlock->getFirstNonPHIOrDbgOrLifetime();
-         
-         BasicBlock *original = basicBlock->splitBasicBlock(ii, "original");
-         basicBlock->getTerminator()->eraseFromParent();
-         
-         int select = llvm::cryptoutils->get_range(INT8_MAX) % pads.size();
-         BasicBlock *puzzleJmp = pads.at(select);
-         
-         int ibase = (int)llvm::cryptoutils->get_range(INT16_MAX);
-         int iadd = (int)llvm::cryptoutils->get_range(INT8_MAX);
-         
-         Value *var1 = ConstantInt::get(Type::getInt32Ty(F.getContext()), ibase, false);
-         Value *var2 = ConstantInt::get(Type::getInt32Ty(F.getContext()), ibase+iadd, false);
-         
-         ICmpInst *condition = new ICmpInst(*basicBlock, ICmpInst::ICMP_EQ, var1, var2);
-         BranchInst::Create(puzzleJmp, original, (Value*)condition, basicBlock)->setBogusBranch(true);
-         }
-         */
-      };
+    BogusControlFlow() : FunctionPass(ID), loops(NULL) {this->flag = true;}
+    BogusControlFlow(bool flag) : FunctionPass(ID), loops(NULL) {this->flag = flag;}
+    
+    /*
+     * Weak and hidden: the initializer may be interposed, so nothing folds the
+     * load; llvm.used keeps internalize (and then GlobalOpt) away from it.
+     */
+    Value *opaqueLoad(IRBuilder<> &irb) {
+      Module &M = *irb.GetInsertBlock()->getModule();
+      GlobalVariable *gv = M.getGlobalVariable("morphling.opaque", true);
+      if (!gv) {
+        Type *i32ty = irb.getInt32Ty();
+        gv = new GlobalVariable(M, i32ty, false, GlobalValue::WeakAnyLinkage,
+                                ConstantInt::get(i32ty, 0), "morphling.opaque");
+        gv->setVisibility(GlobalValue::HiddenVisibility);
+        appendToUsed(M, {gv});
+      }
+      return irb.CreateLoad(gv);
+    }
+    
+    Value *liveValue(IRBuilder<> &irb) {
+      if (lives.empty())
+        return opaqueLoad(irb);
+      Value *v = lives.at(crypto.choose(lives.size()));
+      return irb.CreateZExtOrTrunc(v, irb.getInt32Ty());
+    }
+    
+    /* a few unreachable blocks per function, handed out at random once full */
+    BasicBlock *trapBlock(Function &F) {
+      if (traps.size() < (size_t)std::max(bcfOptions().traps, 1)) {
+        BasicBlock *puzzleJmp = BasicBlock::Create(F.getContext(), "puzzleJmp", &F);
+        new UnreachableInst(F.getContext(), puzzleJmp);
+        traps.push_back(puzzleJmp);
+        return puzzleJmp;
+      }
+      return traps.at(crypto.choose(traps.size()));
+    }
+    
+    /* hot blocks (inside loops) only get the single compare */
+    Value *opaquePredicate(Function &F, BasicBlock *basicBlock) {
+      unsigned budget = loops && loops->getLoopDepth(basicBlock) ? 1 : UINT_MAX;
+      SmallVector<unsigned, array_lengthof(predBox)> fits;
+      for (unsigned i = 0; i < array_lengthof(predBox); i++)
+        if (predBox[i].cost <= budget)
+          fits.push_back(i);
+      
+      IRBuilder<> irb(basicBlock);
+      Instruction *last = basicBlock->empty() ? NULL : &basicBlock->back();
+      Value *condition = predBox[fits[crypto.choose(fits.size())]].build(this, irb);
+      
+      /* random blocks get these, keep them out of later site numbering */
+      BasicBlock::iterator it = last ? std::next(last->getIterator()) : basicBlock->begin();
+      for (; it != basicBlock->end(); ++it)
+        Morphling::markGenerated(&*it);
+      return condition;
+    }
+    
+    /* integer values defined in the entry block dominate every other block */
+    void collectLives(Function &F) {
+      lives.clear();
+      for (Argument &arg : F.args())
+        if (arg.getType()->isIntegerTy())
+          lives.push_back(&arg);
+      for (Instruction &inst : F.getEntryBlock())
+        if (inst.getType()->isIntegerTy() && !isa<PHINode>(inst))
+          lives.push_back(&inst);
     }
     
     bool checkParams() {
-      if (!((bcf_rate > 0) && (bcf_rate <= 100))) {
+      int rate = bcfOptions().rate;
+      if (!((rate > 0) && (rate <= 100))) {
         return false;
       }
       return true;
@@ -120,16 +181,12 @@ namespace {
     }
     
     bool optimize(Function &F) {
-      errs() << "Running BCF On " << F.getName() << "\n";
+      DEBUG(dbgs() << "Running BCF On " << F.getName() << "\n");
       bogus(F);
       return true;
     }
     
     bool runOnFunction(Function &F) override {
-      rp::Value config = Morphling::getConfig("obfuscation.bcfobf");
-      if (config.HasMember("bcf_rate"))
-        bcf_rate = config.FindMember("bcf_rate")->value.GetInt();
-      
       if (!checkParams())
         return false;
       
@@ -171,8 +228,15 @@ namespace {
           basicBlocks.push_back(BB);
       }
       
-      std::vector<BasicBlock *> pads = basicBlocks;
+      DominatorTree DT(F);
+      LoopInfo LI(DT);
+      loops = &LI;
+      collectLives(F);
+      traps.clear();
+      OptimizationRemarkEmitter ORE(&F);
       
+      unsigned ordinal = 0;
+      SmallVector<GlobalValue *, 16> counters;
       while (!basicBlocks.empty()) {
         BasicBlock *basicBlock = basicBlocks.back();
         basicBlocks.pop_back();
@@ -180,16 +244,89 @@ namespace {
         if (!canOptimized(basicBlock))
           continue;
         
-        if ((llvm::cryptoutils->get_range(INT16_MAX) % 100L) >= bcf_rate)
+        uint64_t site = Morphling::siteId(F, DEBUG_TYPE, ordinal++);
+        if (Morphling::isHotSite(site))
+          continue;
+        
+        if (!crypto.get_bool(bcfOptions().rate))
           continue;
         
         optimized = true;
-        routeBox.at(llvm::cryptoutils->get_range(INT16_MAX) % routeBox.size())(F, basicBlock, pads);
+        unsigned route = crypto.choose(array_lengthof(routeBox));
+        routeBox[route](this, F, basicBlock);
+        
+        if (Morphling::shouldCountSites()) {
+          BasicBlock *original = cast<BranchInst>(basicBlock->getTerminator())->getSuccessor(1);
+          counters.push_back(Morphling::countSite(&*original->getFirstInsertionPt(), site));
+        }
+        
+        /* basicBlock is now only the predicate and its branch, on the real path */
+        ORE.emit([&]() {
+          BranchInst *bi = cast<BranchInst>(basicBlock->getTerminator());
+          return OptimizationRemark(DEBUG_TYPE, "BogusEdge", bi->getSuccessor(1)->getFirstNonPHI())
+                 << "bogus edge via route " << ore::NV("Route", route)
+                 << ", cost " << ore::NV("Cost", (unsigned)basicBlock->size());
+        });
       }
       
+      if (!counters.empty())
+        appendToUsed(*F.getParent(), counters);
+      
+      loops = NULL;
+      traps.clear();
       return optimized;
     }
   };
+  
+  /* g == k, g an interposable global that nobody writes (always 0) */
+  Value *predGlobal(BogusControlFlow *pass, IRBuilder<> &irb) {
+    Value *k = irb.getInt32(pass->crypto.get_uint32_t() | 1);
+    return irb.CreateICmpEQ(pass->opaqueLoad(irb), k);
+  }
+  
+  /* x * (x + 1) is even */
+  Value *predEven(BogusControlFlow *pass, IRBuilder<> &irb) {
+    Value *x = pass->liveValue(irb);
+    Value *v = irb.CreateMul(x, irb.CreateAdd(x, irb.getInt32(1)));
+    return irb.CreateICmpNE(irb.CreateAnd(v, irb.getInt32(1)), irb.getInt32(0));
+  }
+  
+  /* 7y^2 - 1 != x^2, already mod 8 */
+  Value *predSquare(BogusControlFlow *pass, IRBuilder<> &irb) {
+    Value *x = pass->liveValue(irb);
+    Value *y = pass->liveValue(irb);
+    Value *l = irb.CreateMul(irb.CreateMul(y, y), irb.getInt32(7));
+    l = irb.CreateSub(l, irb.getInt32(1));
+    return irb.CreateICmpEQ(l, irb.CreateMul(x, x));
+  }
+  
+  /* slight1 */
+  void routeSelfLoop(BogusControlFlow *pass, Function &F, BasicBlock *basicBlock) {
+    BasicBlock::iterator ii = basicBlock->begin();
+    if (basicBlock->getFirstNonPHIOrDbgOrLifetime())
+      ii = (BasicBlock::iterator)basicBlock->getFirstNonPHIOrDbgOrLifetime();
+    
+    BasicBlock *original = basicBlock->splitBasicBlock(ii, "original");
+    basicBlock->getTerminator()->eraseFromParent();
+    
+    Value *condition = pass->opaquePredicate(F, basicBlock);
+    Morphling::markBogus(BranchInst::Create(basicBlock, original, condition, basicBlock), 0);
+  }
+  
+  /* slight2 */
+  void routeTrap(BogusControlFlow *pass, Function &F, BasicBlock *basicBlock) {
+    BasicBlock::iterator ii = basicBlock->begin();
+    if (basicBlock->getFirstNonPHIOrDbgOrLifetime())
+      ii = (BasicBlock::iterator)basicBlock->getFirstNonPHIOrDbgOrLifetime();
+    
+    BasicBlock *original = basicBlock->splitBasicBlock(ii, "original");
+    basicBlock->getTerminator()->eraseFromParent();
+    
+    BasicBlock *puzzleJmp = pass->trapBlock(F);
+    
+    Value *condition = pass->opaquePredicate(F, basicBlock);
+    Morphling::markBogus(BranchInst::Create(puzzleJmp, original, condition, basicBlock), 0);
+  }
 }
 
 char BogusControlFlow::ID = 0;
@@ -21,11 +21,13 @@
 #include "llvm/ADT/Statistic.h"
 #include "llvm/ADT/Twine.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/ErrorHandling.h"
 #include "llvm/Support/ManagedStatic.h"
 #include "llvm/Support/raw_ostream.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cstdio>
 #include <cstdlib>
@@ -34,12 +36,19 @@
 #include <string>
 #include <random>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
 // Stats
 #define DEBUG_TYPE "CryptoUtils"
 
 using namespace llvm;
 
 namespace llvm {
+// Compatibility shim only: the obfuscation passes own their own CryptoUtils
+// streams, which share no state and need no locking across threads.
 ManagedStatic<CryptoUtils> cryptoutils;
 }
 
@@ -479,16 +488,10 @@ const uint32_t AES_PRECOMP_TE4_3[256] = {
     0x2d000000UL, 0x0f000000UL, 0xb0000000UL, 0x54000000UL, 0xbb000000UL,
     0x16000000UL};
 
-const uint32_t masks[32] = {
-    0x80000000UL, 0x40000000UL, 0x20000000UL, 0x10000000UL, 0x08000000UL,
-    0x04000000UL, 0x02000000UL, 0x01000000UL, 0x00800000UL, 0x00400000UL,
-    0x00200000UL, 0x00100000UL, 0x00080000UL, 0x00040000UL, 0x00020000UL,
-    0x00010000UL, 0x00008000UL, 0x00004000UL, 0x00002000UL, 0x00001000UL,
-    0x00000800UL, 0x00000400UL, 0x00000200UL, 0x00000100UL, 0x00000080UL,
-    0x00000040UL, 0x00000020UL, 0x00000010UL, 0x00000008UL, 0x00000004UL,
-    0x00000002UL, 0x00000001UL};
-
-CryptoUtils::CryptoUtils() { seeded = false; }
+CryptoUtils::CryptoUtils() {
+  seeded = false;
+  idx = 0;
+}
 
 unsigned CryptoUtils::scramble32(const unsigned in, const char key[16]) {
   assert(key != NULL && "CryptoUtils::scramble key=NULL");
@@ -619,6 +622,10 @@ bool CryptoUtils::prng_seed() {
   aes_compute_ks(ks, key);
 
   seeded = true;
+
+  // Same as the explicit seed: the pool is always ready
+  // once seeded, the fast paths rely on it
+  populate_pool();
   return true;
 }
 
@@ -646,33 +653,42 @@ void CryptoUtils::get_bytes(char *buffer, const int len) {
   assert(buffer != NULL && "CryptoUtils::get_bytes buffer=NULL");
   assert(len > 0 && "CryptoUtils::get_bytes len <= 0");
 
-  if (len > 0) {
+  if (len <= 0) {
+    return;
+  }
 
-    // If the PRNG is not seeded, it the very last time to do it !
-    if (!seeded) {
-      prng_seed();
-      populate_pool();
-    }
+  // If the PRNG is not seeded, it the very last time to do it !
+  if (!seeded) {
+    prng_seed();
+  }
 
-    do {
-      if (idx + (len - sofar) >= CryptoUtils_POOL_SIZE) {
-        // We don't have enough bytes ready in the pool,
-        // so let's use the available ones and repopulate !
-        available = CryptoUtils_POOL_SIZE - idx;
-        memcpy(buffer + sofar, pool + idx, available);
-        sofar += available;
-        populate_pool();
-      } else {
-        memcpy(buffer + sofar, pool + idx, len - sofar);
-        idx += len - sofar;
-        // This will trigger a loop exit
-        sofar = len;
-      }
-    } while (sofar < (len - 1));
+  // First drain what is left in the pool
+  available = MIN(len, CryptoUtils_POOL_SIZE - idx);
+  memcpy(buffer, pool + idx, available);
+  idx += available;
+  sofar = available;
+
+  // Whole blocks are encrypted straight into the caller's buffer,
+  // they would only be copied out of the pool otherwise
+  while (len - sofar >= 16) {
+    inc_ctr();
+    aes_encrypt(buffer + sofar, ctr, ks);
+    sofar += 16;
+  }
+
+  // The tail comes from a fresh pool
+  if (sofar < len) {
+    populate_pool();
+    memcpy(buffer + sofar, pool, len - sofar);
+    idx = len - sofar;
   }
 }
 
 uint8_t CryptoUtils::get_uint8_t() {
+  if (seeded && idx < CryptoUtils_POOL_SIZE) {
+    return (uint8_t)pool[idx++];
+  }
+
   char ret;
   get_bytes(&ret, 1);
   return (uint8_t)ret;
@@ -680,57 +696,71 @@ uint8_t CryptoUtils::get_uint8_t() {
 uint16_t CryptoUtils::get_uint16_t() { return (uint16_t)get_uint64_t(); }
 
 char CryptoUtils::get_char() {
-  char ret;
-
-  get_bytes(&ret, 1);
-
-  return ret;
+  return (char)get_uint8_t();
 }
 
 uint32_t CryptoUtils::get_uint32_t() {
-  char tmp[4];
   uint32_t ret = 0;
 
-  get_bytes(tmp, 4);
+  if (seeded && idx + 4 <= CryptoUtils_POOL_SIZE) {
+    LOAD32H(ret, pool + idx);
+    idx += 4;
+    return ret;
+  }
 
+  char tmp[4];
+  get_bytes(tmp, 4);
   LOAD32H(ret, tmp);
 
   return ret;
 }
 
 uint64_t CryptoUtils::get_uint64_t() {
-  char tmp[8];
   uint64_t ret = 0;
 
-  get_bytes(tmp, 8);
+  if (seeded && idx + 8 <= CryptoUtils_POOL_SIZE) {
+    LOAD64H(ret, pool + idx);
+    idx += 8;
+    return ret;
+  }
 
+  char tmp[8];
+  get_bytes(tmp, 8);
   LOAD64H(ret, tmp);
 
   return ret;
 }
 
 uint32_t CryptoUtils::get_range(const uint32_t max) {
-  uint32_t log, r, mask;
+  uint64_t m;
+  uint32_t l, t;
 
   if (max == 0) {
     return 0;
-  } else {
-    // Computing the above power of two
-    log = 32;
-    int i = 0;
-    // This loop will terminate, as there is at least one
-    // bit set somewhere in max
-    while (!(max & masks[i++])) {
-      log -= 1;
-    }
-    mask = (0x1UL << log) - 1;
+  }
 
-    // This should loop two times in average
-    do {
-      r = get_uint32_t() & mask;
-    } while (r >= max);
-    return r;
+  // Lemire's multiply-shift: the high word of r * max is uniform
+  // in [0, max) once the low word clears max's rejection threshold,
+  // which only ever fails with probability max / 2^32
+  m = (uint64_t)get_uint32_t() * max;
+  l = (uint32_t)m;
+  if (l < max) {
+    t = (0U - max) % max;
+    while (l < t) {
+      m = (uint64_t)get_uint32_t() * max;
+      l = (uint32_t)m;
+    }
   }
+  return (uint32_t)(m >> 32);
+}
+
+bool CryptoUtils::get_bool(const uint32_t percent) {
+  return get_range(100) < percent;
+}
+
+uint32_t CryptoUtils::choose(const uint32_t n) {
+  assert(n > 0 && "CryptoUtils::choose n == 0");
+  return get_range(n);
 }
 
 void CryptoUtils::aes_compute_ks(uint32_t *ks, const char *k) {
@@ -825,6 +855,380 @@ void CryptoUtils::aes_encrypt(char *out, const char *in, const uint32_t *ks) {
   STORE32H(out + 12, state3);
 }
 
+//===----------------------------------------------------------------------===//
+// SHA-256
+//
+// Block functions take the eight state words and any number of consecutive
+// 64-byte blocks. The portable one is always there; SHA-NI replaces it, and
+// without SHA-NI, AVX2 hashes independent messages eight lanes at a time.
+// Either is only used when cpuid says so and the known answers come out right.
+//===----------------------------------------------------------------------===//
+
+typedef void (*sha256_blocks_fn)(uint32_t *state, const unsigned char *in,
+                                 size_t blocks);
+
+static const uint32_t SHA256_IV[8] = {
+    0x6A09E667UL, 0xBB67AE85UL, 0x3C6EF372UL, 0xA54FF53AUL,
+    0x510E527FUL, 0x9B05688CUL, 0x1F83D9ABUL, 0x5BE0CD19UL};
+
+static const uint32_t SHA256_K[64] = {
+    0x428a2f98UL, 0x71374491UL, 0xb5c0fbcfUL, 0xe9b5dba5UL, 0x3956c25bUL,
+    0x59f111f1UL, 0x923f82a4UL, 0xab1c5ed5UL, 0xd807aa98UL, 0x12835b01UL,
+    0x243185beUL, 0x550c7dc3UL, 0x72be5d74UL, 0x80deb1feUL, 0x9bdc06a7UL,
+    0xc19bf174UL, 0xe49b69c1UL, 0xefbe4786UL, 0x0fc19dc6UL, 0x240ca1ccUL,
+    0x2de92c6fUL, 0x4a7484aaUL, 0x5cb0a9dcUL, 0x76f988daUL, 0x983e5152UL,
+    0xa831c66dUL, 0xb00327c8UL, 0xbf597fc7UL, 0xc6e00bf3UL, 0xd5a79147UL,
+    0x06ca6351UL, 0x14292967UL, 0x27b70a85UL, 0x2e1b2138UL, 0x4d2c6dfcUL,
+    0x53380d13UL, 0x650a7354UL, 0x766a0abbUL, 0x81c2c92eUL, 0x92722c85UL,
+    0xa2bfe8a1UL, 0xa81a664bUL, 0xc24b8b70UL, 0xc76c51a3UL, 0xd192e819UL,
+    0xd6990624UL, 0xf40e3585UL, 0x106aa070UL, 0x19a4c116UL, 0x1e376c08UL,
+    0x2748774cUL, 0x34b0bcb5UL, 0x391c0cb3UL, 0x4ed8aa4aUL, 0x5b9cca4fUL,
+    0x682e6ff3UL, 0x748f82eeUL, 0x78a5636fUL, 0x84c87814UL, 0x8cc70208UL,
+    0x90befffaUL, 0xa4506cebUL, 0xbef9a3f7UL, 0xc67178f2UL};
+
+static void sha256_blocks_generic(uint32_t *state, const unsigned char *in,
+                                  size_t blocks) {
+  uint32_t S[8], W[64], t0, t1;
+  int i;
+
+  for (; blocks > 0; blocks--, in += 64) {
+    /* copy state into S */
+    for (i = 0; i < 8; i++) {
+      S[i] = state[i];
+    }
+
+    /* copy the state into 512-bits into W[0..15] */
+    for (i = 0; i < 16; i++) {
+      LOAD32H(W[i], in + (4 * i));
+    }
+
+    /* fill W[16..63] */
+    for (i = 16; i < 64; i++) {
+      W[i] = Gamma1(W[i - 2]) + W[i - 7] + Gamma0(W[i - 15]) + W[i - 16];
+    }
+
+    /* Compress */
+    for (i = 0; i < 64; i += 8) {
+      RND(S[0], S[1], S[2], S[3], S[4], S[5], S[6], S[7], i + 0, SHA256_K[i + 0]);
+      RND(S[7], S[0], S[1], S[2], S[3], S[4], S[5], S[6], i + 1, SHA256_K[i + 1]);
+      RND(S[6], S[7], S[0], S[1], S[2], S[3], S[4], S[5], i + 2, SHA256_K[i + 2]);
+      RND(S[5], S[6], S[7], S[0], S[1], S[2], S[3], S[4], i + 3, SHA256_K[i + 3]);
+      RND(S[4], S[5], S[6], S[7], S[0], S[1], S[2], S[3], i + 4, SHA256_K[i + 4]);
+      RND(S[3], S[4], S[5], S[6], S[7], S[0], S[1], S[2], i + 5, SHA256_K[i + 5]);
+      RND(S[2], S[3], S[4], S[5], S[6], S[7], S[0], S[1], i + 6, SHA256_K[i + 6]);
+      RND(S[1], S[2], S[3], S[4], S[5], S[6], S[7], S[0], i + 7, SHA256_K[i + 7]);
+    }
+
+    /* feedback */
+    for (i = 0; i < 8; i++) {
+      state[i] = state[i] + S[i];
+    }
+  }
+}
+
+/*
+ * Pads the last rem (< 64) bytes of a len-byte message into tail; returns the
+ * number of blocks written (1 or 2).
+ */
+static size_t sha256_pad(unsigned char *tail, const unsigned char *rest,
+                         size_t rem, uint64_t len) {
+  size_t blocks = rem < 56 ? 1 : 2;
+  memcpy(tail, rest, rem);
+  tail[rem] = (unsigned char)0x80;
+  memset(tail + rem + 1, 0, 64 * blocks - rem - 1);
+  STORE64H(tail + 64 * blocks - 8, len * 8);
+  return blocks;
+}
+
+static void sha256_oneshot(sha256_blocks_fn blocks, const unsigned char *msg,
+                           size_t len, unsigned char *out) {
+  uint32_t state[8];
+  unsigned char tail[128];
+  int i;
+
+  memcpy(state, SHA256_IV, sizeof(state));
+  blocks(state, msg, len / 64);
+  blocks(state, tail, sha256_pad(tail, msg + len - len % 64, len % 64, len));
+  for (i = 0; i < 8; i++) {
+    STORE32H(out + (4 * i), state[i]);
+  }
+}
+
+/* FIPS 180-2 appendix B.1 and B.2 */
+static const char SHA256_KAT_ABC[] = "abc";
+static const char SHA256_KAT_448[] =
+    "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+static const unsigned char SHA256_KAT_DIGESTS[2][32] = {
+    {0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40,
+     0xde, 0x5d, 0xae, 0x22, 0x23, 0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17,
+     0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad},
+    {0x24, 0x8d, 0x6a, 0x61, 0xd2, 0x06, 0x38, 0xb8, 0xe5, 0xc0, 0x26,
+     0x93, 0x0c, 0x3e, 0x60, 0x39, 0xa3, 0x3c, 0xe4, 0x59, 0x64, 0xff,
+     0x21, 0x67, 0xf6, 0xec, 0xed, 0xd4, 0x19, 0xdb, 0x06, 0xc1}};
+
+static bool sha256_selfcheck(sha256_blocks_fn blocks) {
+  unsigned char out[32];
+  sha256_oneshot(blocks, (const unsigned char *)SHA256_KAT_ABC,
+                 sizeof(SHA256_KAT_ABC) - 1, out);
+  if (memcmp(out, SHA256_KAT_DIGESTS[0], 32) != 0)
+    return false;
+  sha256_oneshot(blocks, (const unsigned char *)SHA256_KAT_448,
+                 sizeof(SHA256_KAT_448) - 1, out);
+  return memcmp(out, SHA256_KAT_DIGESTS[1], 32) == 0;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/*
+ * SHA-NI keeps the state as ABEF/CDGH and does two rounds per sha256rnds2;
+ * msg1/msg2 extend the schedule four words at a time.
+ */
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_shani(uint32_t *state, const unsigned char *in,
+                                size_t blocks) {
+  const __m128i MASK =
+      _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  __m128i STATE0, STATE1, TMP, ABEF, CDGH, M[4];
+
+  TMP = _mm_loadu_si128((const __m128i *)&state[0]);
+  STATE1 = _mm_loadu_si128((const __m128i *)&state[4]);
+  TMP = _mm_shuffle_epi32(TMP, 0xB1);          /* CDAB */
+  STATE1 = _mm_shuffle_epi32(STATE1, 0x1B);    /* EFGH */
+  STATE0 = _mm_alignr_epi8(TMP, STATE1, 8);    /* ABEF */
+  STATE1 = _mm_blend_epi16(STATE1, TMP, 0xF0); /* CDGH */
+
+  for (; blocks > 0; blocks--, in += 64) {
+    ABEF = STATE0;
+    CDGH = STATE1;
+
+    for (int i = 0; i < 16; i++) {
+      __m128i W;
+      if (i < 4) {
+        W = _mm_loadu_si128((const __m128i *)(in + 16 * i));
+        W = _mm_shuffle_epi8(W, MASK);
+      } else {
+        /* W[t-16] + s0(W[t-15]) + W[t-7] + s1(W[t-2]) */
+        W = _mm_sha256msg1_epu32(M[i & 3], M[(i + 1) & 3]);
+        W = _mm_add_epi32(W, _mm_alignr_epi8(M[(i + 3) & 3], M[(i + 2) & 3], 4));
+        W = _mm_sha256msg2_epu32(W, M[(i + 3) & 3]);
+      }
+      M[i & 3] = W;
+
+      TMP = _mm_add_epi32(W, _mm_loadu_si128((const __m128i *)&SHA256_K[4 * i]));
+      STATE1 = _mm_sha256rnds2_epu32(STATE1, STATE0, TMP);
+      TMP = _mm_shuffle_epi32(TMP, 0x0E);
+      STATE0 = _mm_sha256rnds2_epu32(STATE0, STATE1, TMP);
+    }
+
+    STATE0 = _mm_add_epi32(STATE0, ABEF);
+    STATE1 = _mm_add_epi32(STATE1, CDGH);
+  }
+
+  TMP = _mm_shuffle_epi32(STATE0, 0x1B);       /* FEBA */
+  STATE1 = _mm_shuffle_epi32(STATE1, 0xB1);    /* DCHG */
+  STATE0 = _mm_blend_epi16(TMP, STATE1, 0xF0); /* DCBA */
+  STATE1 = _mm_alignr_epi8(STATE1, TMP, 8);    /* HGFE */
+
+  _mm_storeu_si128((__m128i *)&state[0], STATE0);
+  _mm_storeu_si128((__m128i *)&state[4], STATE1);
+}
+
+#define SHA256_X8_ROR(x, n)                                                    \
+  _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+
+/*
+ * One block of eight independent messages: lane l of state[w] is word w of
+ * message l. Lanes not set in live keep their state.
+ */
+__attribute__((target("avx2")))
+static void sha256_x8_avx2(uint32_t (*state)[8], const unsigned char *const *in,
+                           unsigned live) {
+  __m256i S[8], W[16], a, b, c, d, e, f, g, h, t0, t1;
+  uint32_t w[8];
+  int i, l;
+
+  for (i = 0; i < 8; i++)
+    S[i] = _mm256_loadu_si256((const __m256i *)state[i]);
+  a = S[0], b = S[1], c = S[2], d = S[3];
+  e = S[4], f = S[5], g = S[6], h = S[7];
+
+  for (i = 0; i < 64; i++) {
+    if (i < 16) {
+      for (l = 0; l < 8; l++)
+        LOAD32H(w[l], in[l] + 4 * i);
+      W[i] = _mm256_loadu_si256((const __m256i *)w);
+    } else {
+      __m256i w2 = W[(i - 2) & 15], w15 = W[(i - 15) & 15];
+      t0 = _mm256_xor_si256(_mm256_xor_si256(SHA256_X8_ROR(w15, 7),
+                                             SHA256_X8_ROR(w15, 18)),
+                            _mm256_srli_epi32(w15, 3));
+      t1 = _mm256_xor_si256(_mm256_xor_si256(SHA256_X8_ROR(w2, 17),
+                                             SHA256_X8_ROR(w2, 19)),
+                            _mm256_srli_epi32(w2, 10));
+      W[i & 15] = _mm256_add_epi32(_mm256_add_epi32(W[i & 15], t0),
+                                   _mm256_add_epi32(W[(i - 7) & 15], t1));
+    }
+
+    /* t0 = h + Sigma1(e) + Ch(e, f, g) + K[i] + W[i] */
+    t0 = _mm256_xor_si256(_mm256_xor_si256(SHA256_X8_ROR(e, 6),
+                                           SHA256_X8_ROR(e, 11)),
+                          SHA256_X8_ROR(e, 25));
+    t0 = _mm256_add_epi32(_mm256_add_epi32(h, t0),
+                          _mm256_xor_si256(_mm256_and_si256(e, f),
+                                           _mm256_andnot_si256(e, g)));
+    t0 = _mm256_add_epi32(t0, _mm256_add_epi32(
+                                  _mm256_set1_epi32((int)SHA256_K[i]), W[i & 15]));
+    /* t1 = Sigma0(a) + Maj(a, b, c) */
+    t1 = _mm256_xor_si256(_mm256_xor_si256(SHA256_X8_ROR(a, 2),
+                                           SHA256_X8_ROR(a, 13)),
+                          SHA256_X8_ROR(a, 22));
+    t1 = _mm256_add_epi32(t1, _mm256_or_si256(
+                                  _mm256_and_si256(a, b),
+                                  _mm256_and_si256(c, _mm256_or_si256(a, b))));
+
+    h = g, g = f, f = e;
+    e = _mm256_add_epi32(d, t0);
+    d = c, c = b, b = a;
+    a = _mm256_add_epi32(t0, t1);
+  }
+
+  __m256i mask = _mm256_setr_epi32(
+      -(int)(live & 1), -(int)(live >> 1 & 1), -(int)(live >> 2 & 1),
+      -(int)(live >> 3 & 1), -(int)(live >> 4 & 1), -(int)(live >> 5 & 1),
+      -(int)(live >> 6 & 1), -(int)(live >> 7 & 1));
+  __m256i R[8] = {a, b, c, d, e, f, g, h};
+  for (i = 0; i < 8; i++) {
+    __m256i sum = _mm256_add_epi32(S[i], R[i]);
+    _mm256_storeu_si256((__m256i *)state[i], _mm256_blendv_epi8(S[i], sum, mask));
+  }
+}
+
+#undef SHA256_X8_ROR
+
+/* up to eight messages of any length; short lanes idle once padded out */
+static void sha256_batch_x8(const unsigned char *const *msgs,
+                            const size_t *lens, unsigned n,
+                            unsigned char *hashes) {
+  static const unsigned char zero[64] = {0};
+  uint32_t state[8][8];
+  unsigned char tail[8][128];
+  size_t full[8], total[8], most = 0;
+  unsigned i, l;
+
+  for (i = 0; i < 8; i++)
+    for (l = 0; l < 8; l++)
+      state[i][l] = SHA256_IV[i];
+
+  for (l = 0; l < 8; l++) {
+    if (l >= n) {
+      full[l] = total[l] = 0;
+      continue;
+    }
+    size_t len = lens[l], rem = len % 64;
+    full[l] = len / 64;
+    total[l] = full[l] + sha256_pad(tail[l], msgs[l] + len - rem, rem, len);
+    most = std::max(most, total[l]);
+  }
+
+  for (size_t blk = 0; blk < most; blk++) {
+    const unsigned char *in[8];
+    unsigned live = 0;
+    for (l = 0; l < 8; l++) {
+      if (blk < full[l])
+        in[l] = msgs[l] + 64 * blk;
+      else if (blk < total[l])
+        in[l] = tail[l] + 64 * (blk - full[l]);
+      else
+        in[l] = zero;
+      if (blk < total[l])
+        live |= 1u << l;
+    }
+    sha256_x8_avx2(state, in, live);
+  }
+
+  for (l = 0; l < n; l++)
+    for (i = 0; i < 8; i++)
+      STORE32H(hashes + 32 * l + 4 * i, state[i][l]);
+}
+
+/* lanes of different lengths, both known answers, against the portable code */
+static bool sha256_selfcheck_x8() {
+  const unsigned char *msgs[8];
+  size_t lens[8];
+  unsigned char hashes[8][32], expect[32];
+  unsigned l;
+
+  for (l = 0; l < 8; l++) {
+    const char *kat = l & 1 ? SHA256_KAT_448 : SHA256_KAT_ABC;
+    msgs[l] = (const unsigned char *)kat;
+    lens[l] = l < 2 ? strlen(kat) : strlen(kat) - l / 2;
+  }
+  sha256_batch_x8(msgs, lens, 8, &hashes[0][0]);
+  if (memcmp(hashes[0], SHA256_KAT_DIGESTS[0], 32) != 0 ||
+      memcmp(hashes[1], SHA256_KAT_DIGESTS[1], 32) != 0)
+    return false;
+  for (l = 2; l < 8; l++) {
+    sha256_oneshot(sha256_blocks_generic, msgs[l], lens[l], expect);
+    if (memcmp(hashes[l], expect, 32) != 0)
+      return false;
+  }
+  return true;
+}
+
+/* cpuid leaf 7: EBX bit 29 is SHA, bit 5 AVX2; the OS has to save the ymm state */
+static void sha256_cpu(bool &sha, bool &avx2) {
+  unsigned a, b, c, d;
+  sha = avx2 = false;
+  if (__get_cpuid_max(0, NULL) < 7)
+    return;
+  __cpuid(1, a, b, c, d);
+  bool sse41 = c & bit_SSE4_1;
+  bool ymm = (c & bit_OSXSAVE) && (c & bit_AVX);
+  if (ymm) {
+    unsigned lo, hi;
+    __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    ymm = (lo & 6) == 6;
+  }
+  __cpuid_count(7, 0, a, b, c, d);
+  sha = sse41 && (b & (1u << 29));
+  avx2 = ymm && (b & (1u << 5));
+}
+
+#endif
+
+namespace {
+struct SHA256Backend {
+  sha256_blocks_fn blocks;
+  unsigned lanes;
+};
+}
+
+static SHA256Backend sha256_select() {
+  SHA256Backend backend = {sha256_blocks_generic, 1};
+  assert(sha256_selfcheck(sha256_blocks_generic) &&
+         "CryptoUtils: portable sha256 fails its known answers");
+#if defined(__x86_64__) || defined(__i386__)
+  bool sha, avx2;
+  sha256_cpu(sha, avx2);
+  if (sha && sha256_selfcheck(sha256_blocks_shani))
+    backend.blocks = sha256_blocks_shani;
+  /* one SHA-NI stream outruns eight AVX2 lanes; lanes only stand in for generic */
+  if (avx2 && backend.blocks == sha256_blocks_generic && sha256_selfcheck_x8())
+    backend.lanes = 8;
+  DEBUG(dbgs() << "CryptoUtils: sha256 sha-ni " << sha << ", avx2 " << avx2
+               << ", using " << (backend.blocks == sha256_blocks_generic
+                                     ? "generic" : "sha-ni")
+               << " with " << backend.lanes << " lanes\n");
+#endif
+  return backend;
+}
+
+/* picked once; function-local statics are thread safe */
+static const SHA256Backend &sha256_backend() {
+  static const SHA256Backend backend = sha256_select();
+  return backend;
+}
+
 int CryptoUtils::sha256_process(sha256_state *md, const unsigned char *in,
                                 unsigned long inlen) {
   unsigned long n;
@@ -837,12 +1241,12 @@ int CryptoUtils::sha256_process(sha256_state *md, const unsigned char *in,
   }
   while (inlen > 0) {
     if (md->curlen == 0 && inlen >= 64) {
-      if ((err = sha256_compress(md, (unsigned char *)in)) != 0) {
-        return err;
-      }
-      md->length += 64 * 8;
-      in += 64;
-      inlen -= 64;
+      /* whole blocks go to the backend in one call */
+      n = inlen / 64;
+      sha256_backend().blocks(md->state, in, n);
+      md->length += n * 64 * 8;
+      in += n * 64;
+      inlen -= n * 64;
     } else {
       n = MIN(inlen, (64 - md->curlen));
       memcpy(md->buf + md->curlen, in, (size_t)n);
@@ -862,95 +1266,7 @@ int CryptoUtils::sha256_process(sha256_state *md, const unsigned char *in,
 }
 
 int CryptoUtils::sha256_compress(sha256_state *md, unsigned char *buf) {
-  uint32_t S[8], W[64], t0, t1;
-  int i;
-
-  /* copy state into S */
-  for (i = 0; i < 8; i++) {
-    S[i] = md->state[i];
-  }
-
-  /* copy the state into 512-bits into W[0..15] */
-  for (i = 0; i < 16; i++) {
-    LOAD32H(W[i], buf + (4 * i));
-  }
-
-  /* fill W[16..63] */
-  for (i = 16; i < 64; i++) {
-    W[i] = Gamma1(W[i - 2]) + W[i - 7] + Gamma0(W[i - 15]) + W[i - 16];
-  }
-
-  /* Compress */
-
-  RND(S[0], S[1], S[2], S[3], S[4], S[5], S[6], S[7], 0, 0x428a2f98);
-  RND(S[7], S[0], S[1], S[2], S[3], S[4], S[5], S[6], 1, 0x71374491);
-  RND(S[6], S[7], S[0], S[1], S[2], S[3], S[4], S[5], 2, 0xb5c0fbcf);
-  RND(S[5], S[6], S[7], S[0], S[1], S[2], S[3], S[4], 3, 0xe9b5dba5);
-  RND(S[4], S[5], S[6], S[7], S[0], S[1], S[2], S[3], 4, 0x3956c25b);
-  RND(S[3], S[4], S[5], S[6], S[7], S[0], S[1], S[2], 5, 0x59f111f1);
-  RND(S[2], S[3], S[4], S[5], S[6], S[7], S[0], S[1], 6, 0x923f82a4);
-  RND(S[1], S[2], S[3], S[4], S[5], S[6], S[7], S[0], 7, 0xab1c5ed5);
-  RND(S[0], S[1], S[2], S[3], S[4], S[5], S[6], S[7], 8, 0xd807aa98);
-  RND(S[7], S[0], S[1], S[2], S[3], S[4], S[5], S[6], 9, 0x12835b01);
-  RND(S[6], S[7], S[0], S[1], S[2], S[3], S[4], S[5], 10, 0x243185be);
-  RND(S[5], S[6], S[7], S[0], S[1], S[2], S[3], S[4], 11, 0x550c7dc3);
-  RND(S[4], S[5], S[6], S[7], S[0], S[1], S[2], S[3], 12, 0x72be5d74);
-  RND(S[3], S[4], S[5], S[6], S[7], S[0], S[1], S[2], 13, 0x80deb1fe);
-  RND(S[2], S[3], S[4], S[5], S[6], S[7], S[0], S[1], 14, 0x9bdc06a7);
-  RND(S[1], S[2], S[3], S[4], S[5], S[6], S[7], S[0], 15, 0xc19bf174);
-  RND(S[0], S[1], S[2], S[3], S[4], S[5], S[6], S[7], 16, 0xe49b69c1);
-  RND(S[7], S[0], S[1], S[2], S[3], S[4], S[5], S[6], 17, 0xefbe4786);
-  RND(S[6], S[7], S[0], S[1], S[2], S[3], S[4], S[5], 18, 0x0fc19dc6);
-  RND(S[5], S[6], S[7], S[0], S[1], S[2], S[3], S[4], 19, 0x240ca1cc);
-  RND(S[4], S[5], S[6], S[7], S[0], S[1], S[2], S[3], 20, 0x2de92c6f);
-  RND(S[3], S[4], S[5], S[6], S[7], S[0], S[1], S[2], 21, 0x4a7484aa);
-  RND(S[2], S[3], S[4], S[5], S[6], S[7], S[0], S[1], 22, 0x5cb0a9dc);
-  RND(S[1], S[2], S[3], S[4], S[5], S[6], S[7], S[0], 23, 0x76f988da);
-  RND(S[0], S[1], S[2], S[3], S[4], S[5], S[6], S[7], 24, 0x983e5152);
-  RND(S[7], S[0], S[1], S[2], S[3], S[4], S[5], S[6], 25, 0xa831c66d);
-  RND(S[6], S[7], S[0], S[1], S[2], S[3], S[4], S[5], 26, 0xb00327c8);
-  RND(S[5], S[6], S[7], S[0], S[1], S[2], S[3], S[4], 27, 0xbf597fc7);
-  RND(S[4], S[5], S[6], S[7], S[0], S[1], S[2], S[3], 28, 0xc6e00bf3);
-  RND(S[3], S[4], S[5], S[6], S[7], S[0], S[1], S[2], 29, 0xd5a79147);
-  RND(S[2], S[3], S[4], S[5], S[6], S[7], S[0], S[1], 30, 0x06ca6351);
-  RND(S[1], S[2], S[3], S[4], S[5], S[6], S[7], S[0], 31, 0x14292967);
-  RND(S[0], S[1], S[2], S[3], S[4], S[5], S[6], S[7], 32, 0x27b70a85);
-  RND(S[7], S[0], S[1], S[2], S[3], S[4], S[5], S[6], 33, 0x2e1b2138);
-  RND(S[6], S[7], S[0], S[1], S[2], S[3], S[4], S[5], 34, 0x4d2c6dfc);
-  RND(S[5], S[6], S[7], S[0], S[1], S[2], S[3], S[4], 35, 0x53380d13);
-  RND(S[4], S[5], S[6], S[7], S[0], S[1], S[2], S[3], 36, 0x650a7354);
-  RND(S[3], S[4], S[5], S[6], S[7], S[0], S[1], S[2], 37, 0x766a0abb);
-  RND(S[2], S[3], S[4], S[5], S[6], S[7], S[0], S[1], 38, 0x81c2c92e);
-  RND(S[1], S[2], S[3], S[4], S[5], S[6], S[7], S[0], 39, 0x92722c85);
-  RND(S[0], S[1], S[2], S[3], S[4], S[5], S[6], S[7], 40, 0xa2bfe8a1);
-  RND(S[7], S[0], S[1], S[2], S[3], S[4], S[5], S[6], 41, 0xa81a664b);
-  RND(S[6], S[7], S[0], S[1], S[2], S[3], S[4], S[5], 42, 0xc24b8b70);
-  RND(S[5], S[6], S[7], S[0], S[1], S[2], S[3], S[4], 43, 0xc76c51a3);
-  RND(S[4], S[5], S[6], S[7], S[0], S[1], S[2], S[3], 44, 0xd192e819);
-  RND(S[3], S[4], S[5], S[6], S[7], S[0], S[1], S[2], 45, 0xd6990624);
-  RND(S[2], S[3], S[4], S[5], S[6], S[7], S[0], S[1], 46, 0xf40e3585);
-  RND(S[1], S[2], S[3], S[4], S[5], S[6], S[7], S[0], 47, 0x106aa070);
-  RND(S[0], S[1], S[2], S[3], S[4], S[5], S[6], S[7], 48, 0x19a4c116);
-  RND(S[7], S[0], S[1], S[2], S[3], S[4], S[5], S[6], 49, 0x1e376c08);
-  RND(S[6], S[7], S[0], S[1], S[2], S[3], S[4], S[5], 50, 0x2748774c);
-  RND(S[5], S[6], S[7], S[0], S[1], S[2], S[3], S[4], 51, 0x34b0bcb5);
-  RND(S[4], S[5], S[6], S[7], S[0], S[1], S[2], S[3], 52, 0x391c0cb3);
-  RND(S[3], S[4], S[5], S[6], S[7], S[0], S[1], S[2], 53, 0x4ed8aa4a);
-  RND(S[2], S[3], S[4], S[5], S[6], S[7], S[0], S[1], 54, 0x5b9cca4f);
-  RND(S[1], S[2], S[3], S[4], S[5], S[6], S[7], S[0], 55, 0x682e6ff3);
-  RND(S[0], S[1], S[2], S[3], S[4], S[5], S[6], S[7], 56, 0x748f82ee);
-  RND(S[7], S[0], S[1], S[2], S[3], S[4], S[5], S[6], 57, 0x78a5636f);
-  RND(S[6], S[7], S[0], S[1], S[2], S[3], S[4], S[5], 58, 0x84c87814);
-  RND(S[5], S[6], S[7], S[0], S[1], S[2], S[3], S[4], 59, 0x8cc70208);
-  RND(S[4], S[5], S[6], S[7], S[0], S[1], S[2], S[3], 60, 0x90befffa);
-  RND(S[3], S[4], S[5], S[6], S[7], S[0], S[1], S[2], 61, 0xa4506ceb);
-  RND(S[2], S[3], S[4], S[5], S[6], S[7], S[0], S[1], 62, 0xbef9a3f7);
-  RND(S[1], S[2], S[3], S[4], S[5], S[6], S[7], S[0], 63, 0xc67178f2);
-
-  /* feedback */
-  for (i = 0; i < 8; i++) {
-    md->state[i] = md->state[i] + S[i];
-  }
+  sha256_backend().blocks(md->state, buf, 1);
   return 0;
 }
 
@@ -1037,3 +1353,70 @@ int CryptoUtils::sha256(const char *msg, unsigned char *hash) {
   memcpy(hash, tmp, 32);
   return 0;
 }
+
+/**
+   Hash count independent messages
+   @param msgs    The messages
+   @param lens    Their lengths in bytes
+   @param count   How many there are
+   @param hashes  [out] count consecutive 32-byte digests
+   @return CRYPT_OK if successful
+*/
+int CryptoUtils::sha256_multi(const unsigned char *const *msgs,
+                              const size_t *lens, unsigned count,
+                              unsigned char *hashes) {
+  const SHA256Backend &backend = sha256_backend();
+  unsigned i = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+  /* a lone message is faster on the single-stream backend */
+  if (backend.lanes == 8) {
+    for (; count - i >= 2; i += std::min(count - i, 8u)) {
+      sha256_batch_x8(msgs + i, lens + i, std::min(count - i, 8u),
+                      hashes + 32 * i);
+    }
+  }
+#endif
+  for (; i < count; i++) {
+    sha256_oneshot(backend.blocks, msgs[i], lens[i], hashes + 32 * i);
+  }
+  return 0;
+}
+
+/* printed IR goes through the hash a buffer at a time, never as one string */
+int CryptoUtils::sha256(const Value &V, unsigned char *hash) {
+  raw_sha256_ostream os;
+  V.print(os);
+  os.final(hash);
+  return 0;
+}
+
+int CryptoUtils::sha256(const Module &M, unsigned char *hash) {
+  raw_sha256_ostream os;
+  M.print(os, nullptr);
+  os.final(hash);
+  return 0;
+}
+
+raw_sha256_ostream::raw_sha256_ostream() : pos(0) {
+  CryptoUtils::sha256_init(&md);
+}
+
+raw_sha256_ostream::~raw_sha256_ostream() {
+  flush();
+}
+
+void raw_sha256_ostream::write_impl(const char *ptr, size_t size) {
+  CryptoUtils::sha256_process(&md, (const unsigned char *)ptr,
+                              (unsigned long)size);
+  pos += size;
+}
+
+uint64_t raw_sha256_ostream::current_pos() const {
+  return pos;
+}
+
+void raw_sha256_ostream::final(unsigned char *hash) {
+  flush();
+  CryptoUtils::sha256_done(&md, hash);
+}
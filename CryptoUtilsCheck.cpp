@@ -0,0 +1,67 @@
+//===----------------------------------------------------------------------------------===//
+// CryptoUtilsCheck: get_bytes fills every requested byte with keystream
+//
+//   CryptoUtilsCheck
+//
+// Two generators share a seed. One hands out the keystream a byte at a time
+// from its pool; the other serves requests of odd sizes through get_bytes,
+// starting at unaligned offsets and crossing pool refills, into buffers
+// pre-filled with a sentinel and followed by a guard. Each request must match
+// the keystream byte for byte and leave the guard alone. The run is repeated
+// with a second sentinel, so an unwritten byte cannot pass by matching the
+// keystream. Exits non-zero on the first mismatch.
+//===----------------------------------------------------------------------------------===//
+
+#include "llvm/Transforms/Obfuscation/CryptoUtils.h"
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+using namespace llvm;
+
+static const char *Seed = "0x000102030405060708090a0b0c0d0e0f";
+static const int Guard = 16;
+
+static bool check(unsigned char sentinel) {
+  CryptoUtils reference, bulk;
+  if (!reference.prng_seed(Seed) || !bulk.prng_seed(Seed))
+    return false;
+
+  /* short, block-sized and pool-sized requests, with the ones around them */
+  const int P = CryptoUtils_POOL_SIZE;
+  const int lengths[] = {1, 3, 5, 15, 16, 17, 31, 33, 7,
+                         P - 1, P, P + 1, 2 * P + 7, 13, P - 16, 3 * P + 9};
+
+  long offset = 0;
+  for (int round = 0; round < 4; round++) {
+    for (int len : lengths) {
+      std::vector<unsigned char> buffer(len + Guard, sentinel);
+      bulk.get_bytes((char *)buffer.data(), len);
+
+      for (int i = 0; i < len; i++) {
+        unsigned char want = reference.get_uint8_t();
+        if (buffer[i] != want) {
+          fprintf(stderr, "CryptoUtilsCheck: byte %d of %d at offset %ld: want %02x, got %02x\n",
+                  i, len, offset, want, buffer[i]);
+          return false;
+        }
+      }
+      for (int i = len; i < len + Guard; i++)
+        if (buffer[i] != sentinel) {
+          fprintf(stderr, "CryptoUtilsCheck: request of %d at offset %ld wrote past its end\n",
+                  len, offset);
+          return false;
+        }
+      offset += len;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  for (unsigned char sentinel : {0x00, 0xff})
+    if (!check(sentinel))
+      return 1;
+  printf("CryptoUtilsCheck: ok\n");
+  return 0;
+}
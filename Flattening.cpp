@@ -0,0 +1,216 @@
+//===----------------------------------------------------------------------------------===//
+// LLVM Flattening Pass
+//===----------------------------------------------------------------------------------===//
+
+#include "llvm/ADT/SetVector.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Obfuscation/Morphling.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+
+#define DEBUG_TYPE "Flattening"
+
+using namespace std;
+using namespace llvm;
+
+static cl::opt<int>
+fla_hot("mh_fla_hot",
+        cl::desc("loops this many times hotter than the entry stay unflattened (0: none)"),
+        cl::value_desc("mh_fla_hot"), cl::init(8),
+        cl::Optional);
+
+namespace {
+
+  /* mh_fla_hot with obfuscation.flaobf applied, read once per process */
+  int hotRatio() {
+    static const int ratio = [] {
+      rp::Value config = Morphling::getConfig("obfuscation.flaobf");
+      if (config.HasMember("fla_hot"))
+        return config.FindMember("fla_hot")->value.GetInt();
+      return fla_hot.getValue();
+    }();
+    return ratio;
+  }
+
+  /*
+   * Every flattened block ends by handing an encoded state to one dispatcher.
+   * The state is an SSA phi in the dispatcher; xor with the function key turns
+   * it into a dense index into a block address table, so a transfer is
+   * select + br + xor + load + indirectbr instead of a compare chain.
+   */
+  struct Flattening : public FunctionPass {
+    static char ID;
+    bool flag;
+    CryptoUtils crypto;
+
+    Flattening() : FunctionPass(ID) {this->flag = true;}
+    Flattening(bool flag) : FunctionPass(ID) {this->flag = flag;}
+
+    StringRef getPassName() const override {
+      return StringRef("Flattening");
+    }
+
+    bool runOnFunction(Function &F) override {
+      if (!Morphling::toObfuscate(flag, &F, "fla"))
+        return false;
+
+      if (hasEHPad(F))
+        return false;
+
+      DEBUG(dbgs() << "Running Flattening On " << F.getName() << "\n");
+      return flatten(F);
+    }
+
+    bool hasEHPad(Function &F) {
+      for (BasicBlock &BB : F)
+        if (BB.isEHPad() || isa<InvokeInst>(BB.getTerminator()))
+          return true;
+      return false;
+    }
+
+    /* blocks of loops the profile (or the static estimate) says are hot */
+    void collectHotLoops(Function &F, SmallPtrSetImpl<BasicBlock *> &hot) {
+      int ratio = hotRatio();
+      if (ratio <= 0)
+        return;
+
+      DominatorTree DT(F);
+      LoopInfo LI(DT);
+      BranchProbabilityInfo BPI(F, LI);
+      BlockFrequencyInfo BFI(F, BPI, LI);
+
+      uint64_t entry = BFI.getEntryFreq();
+      for (Loop *L : LI.getLoopsInPreorder()) {
+        uint64_t freq = BFI.getBlockFreq(L->getHeader()).getFrequency();
+        if (freq >= entry * (uint64_t)ratio)
+          hot.insert(L->block_begin(), L->block_end());
+      }
+    }
+
+    bool flatten(Function &F) {
+      LLVMContext &ctx = F.getContext();
+      Module &M = *F.getParent();
+      BasicBlock *entry = &F.getEntryBlock();
+
+      SmallPtrSet<BasicBlock *, 16> hot;
+      collectHotLoops(F, hot);
+
+      /* blocks ending in a plain branch hand over to the dispatcher */
+      vector<BranchInst *> brs;
+      SetVector<BasicBlock *> targets;
+      for (BasicBlock &BB : F) {
+        if (hot.count(&BB))
+          continue;
+        BranchInst *br = dyn_cast<BranchInst>(BB.getTerminator());
+        if (!br)
+          continue;
+        brs.push_back(br);
+        for (BasicBlock *succ : br->successors())
+          targets.insert(succ);
+      }
+
+      if (targets.size() < 2)
+        return false;
+
+      /* incoming blocks are about to become the dispatcher */
+      for (BasicBlock *target : targets) {
+        vector<PHINode *> phis;
+        for (PHINode &phi : target->phis())
+          phis.push_back(&phi);
+        for (PHINode *phi : phis)
+          DemotePHIToStack(phi, entry->getFirstNonPHI());
+      }
+
+      /* dense table, random slot order */
+      vector<BasicBlock *> slots(targets.begin(), targets.end());
+      for (unsigned i = slots.size() - 1; i > 0; i--)
+        swap(slots[i], slots[crypto.choose(i + 1)]);
+
+      DenseMap<BasicBlock *, uint32_t> codes;
+      uint32_t key = crypto.get_uint32_t();
+      vector<Constant *> addresses;
+      for (unsigned i = 0; i < slots.size(); i++) {
+        codes[slots[i]] = i ^ key;
+        addresses.push_back(BlockAddress::get(slots[i]));
+      }
+
+      /* writable, so nothing folds a load from it and threads the dispatch */
+      ArrayType *ayt = ArrayType::get(Type::getInt8PtrTy(ctx), addresses.size());
+      GlobalVariable *table = new GlobalVariable(M, ayt, false, GlobalValue::PrivateLinkage,
+                                                 ConstantArray::get(ayt, addresses),
+                                                 "FlatteningTable");
+      appendToCompilerUsed(M, {table});
+
+      /* dispatcher */
+      BasicBlock *dispatch = BasicBlock::Create(ctx, "dispatch", &F);
+      IRBuilder<> irb(dispatch);
+      PHINode *state = irb.CreatePHI(irb.getInt32Ty(), brs.size(), "state");
+      Value *index = irb.CreateXor(state, irb.getInt32(key));
+      Morphling::markGenerated(index);
+      Value *gep = irb.CreateGEP(table, {irb.getInt32(0), index});
+      LoadInst *target = irb.CreateLoad(gep, "FlatteningTarget");
+      IndirectBrInst *indirBr = irb.CreateIndirectBr(target, slots.size());
+      for (BasicBlock *slot : slots)
+        indirBr->addDestination(slot);
+
+      for (BranchInst *br : brs) {
+        BasicBlock *BB = br->getParent();
+        irb.SetInsertPoint(br);
+        Value *next = irb.getInt32(codes[br->getSuccessor(0)]);
+        if (br->isConditional()) {
+          SelectInst *sel = cast<SelectInst>(irb.CreateSelect(
+              br->getCondition(), next, irb.getInt32(codes[br->getSuccessor(1)])));
+          if (MDNode *prof = br->getMetadata(LLVMContext::MD_prof))
+            sel->setMetadata(LLVMContext::MD_prof, prof);
+          next = sel;
+        }
+        state->addIncoming(next, BB);
+        irb.CreateBr(dispatch);
+        br->eraseFromParent();
+      }
+
+      /* values whose definition no longer dominates their uses go to the stack */
+      DominatorTree DT(F);
+      vector<Instruction *> broken;
+      for (BasicBlock &BB : F) {
+        for (Instruction &I : BB) {
+          if (isa<AllocaInst>(I) && &BB == entry)
+            continue;
+          for (Use &U : I.uses()) {
+            if (!DT.dominates(&I, U)) {
+              broken.push_back(&I);
+              break;
+            }
+          }
+        }
+      }
+      for (Instruction *I : broken)
+        DemoteRegToStack(*I, false, entry->getFirstNonPHI());
+
+      /* every transfer pays select, xor, load and the indirect jump */
+      OptimizationRemarkEmitter ORE(&F);
+      ORE.emit([&]() {
+        return OptimizationRemark(DEBUG_TYPE, "Flattened", entry->getFirstNonPHI())
+               << "flattened " << ore::NV("Blocks", (unsigned)slots.size())
+               << " blocks, " << ore::NV("Demoted", (unsigned)broken.size())
+               << " values demoted, cost " << ore::NV("Cost", 4) << " per transfer";
+      });
+
+      return true;
+    }
+  };
+}
+
+char Flattening::ID = 0;
+INITIALIZE_PASS(Flattening, "flaobf", "Enable Control Flow Flattening.", true, true)
+FunctionPass *llvm::createFlatteningPass() {return new Flattening();}
+FunctionPass *llvm::createFlatteningPass(bool flag) {return new Flattening(flag);}
@@ -18,14 +18,20 @@
  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/IR/CFG.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Value.h"
 #include "llvm/Pass.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Debug.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/Obfuscation/Morphling.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
@@ -35,22 +41,61 @@
 using namespace llvm;
 using namespace std;
 
+#define DEBUG_TYPE "IndirectBranch"
+
 static cl::opt<int>
 inb_rate("mh_inb_rate",
          cl::desc("don't tell you"),
          cl::value_desc("don't tell you"), cl::init(100),
          cl::Optional);
 
+static cl::opt<int>
+inb_density("mh_inb_density",
+            cl::desc("minimum percentage of a switch range covered by cases"),
+            cl::value_desc("mh_inb_density"), cl::init(40),
+            cl::Optional);
+
+static cl::opt<unsigned>
+inb_span("mh_inb_span",
+         cl::desc("largest switch range lowered to a table"),
+         cl::value_desc("mh_inb_span"), cl::init(4096),
+         cl::Optional);
+
+
+namespace {
+  /* mh_inb_* with obfuscation.inbobf applied, read once per process */
+  struct INBOptions {
+    int rate;
+    int density;
+  };
+
+  const INBOptions &inbOptions() {
+    static const INBOptions options = [] {
+      INBOptions options = {inb_rate, inb_density};
+      rp::Value config = Morphling::getConfig("obfuscation.inbobf");
+      if (config.HasMember("inb_rate"))
+        options.rate = config.FindMember("inb_rate")->value.GetInt();
+      if (config.HasMember("inb_density"))
+        options.density = config.FindMember("inb_density")->value.GetInt();
+      return options;
+    }();
+    return options;
+  }
+}
 
 namespace llvm {
   struct IndirectBranch : public FunctionPass {
     static char ID;
     bool flag;
+    CryptoUtils crypto;
+    OptimizationRemarkEmitter *ORE;
+    /* per function: site records, kept with one appendToUsed */
+    SmallVector<GlobalValue *, 16> counters;
 
-    IndirectBranch() : FunctionPass(ID) {
+    IndirectBranch() : FunctionPass(ID), ORE(NULL) {
       this->flag = true;
     }
-    IndirectBranch(bool flag) : FunctionPass(ID) {
+    IndirectBranch(bool flag) : FunctionPass(ID), ORE(NULL) {
       this->flag = flag;
     }
 
@@ -67,12 +112,20 @@ namespace llvm {
       IntegerType* ity = Type::getIntNTy(ctx, layout.getPointerSizeInBits());
       Value *zero = ConstantInt::get(ity, 0);
 
+      unsigned ordinal = 0;
       for (BranchInst *bi : bis) {
         IRBuilder<> irb(bi);
         vector<BasicBlock *> bbs;
 
-        if ((llvm::cryptoutils->get_range(INT16_MAX) % 100L) >= inb_rate)
+        uint64_t site = Morphling::siteId(func, DEBUG_TYPE, ordinal++);
+        if (Morphling::isHotSite(site))
           continue;
+
+        if (!crypto.get_bool(inbOptions().rate))
+          continue;
+
+        if (Morphling::shouldCountSites())
+          counters.push_back(Morphling::countSite(bi, site));
         
         /* [successor(1):false(0), successor(0):true(1)] */
         if (bi->getNumSuccessors() != 2)
@@ -102,6 +155,18 @@ namespace llvm {
         IndirectBrInst *indirBr = IndirectBrInst::Create(li, bbs.size());
         indirBr->addDestination(bbs[0]);
         indirBr->addDestination(bbs[1]);
+        
+        /* keep the edge weights, in destination order */
+        uint64_t trueWeight, falseWeight;
+        if (bi->extractProfMetadata(trueWeight, falseWeight))
+          indirBr->setMetadata(LLVMContext::MD_prof,
+                               MDBuilder(ctx).createBranchWeights(falseWeight, trueWeight));
+
+        /* zext, gep, load and the indirect jump replace one branch */
+        ORE->emit([&]() {
+          return OptimizationRemark(DEBUG_TYPE, "IndirectBranch", bi)
+                 << "branch lowered to indirectbr, cost " << ore::NV("Cost", 3);
+        });
 
         /* apply */
         ReplaceInstWithInst(bi, indirBr);
@@ -109,23 +174,193 @@ namespace llvm {
       return true;
     }
 
+    /* a switch worth lowering: dense enough, small enough, one table slice */
+    struct SwitchSlice {
+      SwitchInst *si;
+      APInt low;
+      uint64_t range;
+      uint64_t base;
+      uint64_t key;
+      uint64_t site;
+    };
+
+    bool denseSwitch(SwitchInst *si, SwitchSlice &slice) {
+      if (si->getNumCases() < 3)
+        return false;
+      if (si->getCondition()->getType()->getIntegerBitWidth() > 64)
+        return false;
+
+      APInt low = si->case_begin()->getCaseValue()->getValue(), high = low;
+      for (auto c : si->cases()) {
+        const APInt &v = c.getCaseValue()->getValue();
+        if (v.slt(low))
+          low = v;
+        if (v.sgt(high))
+          high = v;
+      }
+
+      APInt span = high - low;
+      if (span.uge(inb_span))
+        return false;
+      uint64_t range = span.getZExtValue() + 1;
+      if (si->getNumCases() * 100 < range * inbOptions().density)
+        return false;
+
+      slice.si = si;
+      slice.low = low;
+      slice.range = range;
+      return true;
+    }
+
+    /*
+     * v - low u< range guards an indirectbr through one per-function table;
+     * each switch owns a power-of-two slice indexed by (v - low) ^ key, and
+     * holes and padding point at the default destination.
+     */
+    bool transformSwitches(Function &func, vector<SwitchInst *> &sis) {
+      LLVMContext &ctx = func.getContext();
+      Module &M = *func.getParent();
+      IntegerType *ity = Type::getIntNTy(ctx, M.getDataLayout().getPointerSizeInBits());
+
+      vector<SwitchSlice> slices;
+      vector<Constant *> blockAddresses;
+      unsigned ordinal = 0;
+      for (SwitchInst *si : sis) {
+        SwitchSlice slice;
+        slice.site = Morphling::siteId(func, "IndirectSwitch", ordinal++);
+        if (Morphling::isHotSite(slice.site))
+          continue;
+        if (!crypto.get_bool(inbOptions().rate) || !denseSwitch(si, slice))
+          continue;
+
+        uint64_t size = PowerOf2Ceil(slice.range);
+        slice.base = blockAddresses.size();
+        slice.key = size > 1 ? crypto.get_uint64_t() & (size - 1) : 0;
+
+        blockAddresses.resize(slice.base + size, BlockAddress::get(si->getDefaultDest()));
+        for (auto c : si->cases()) {
+          uint64_t i = (c.getCaseValue()->getValue() - slice.low).getZExtValue();
+          blockAddresses[slice.base + (i ^ slice.key)] = BlockAddress::get(c.getCaseSuccessor());
+        }
+        slices.push_back(slice);
+      }
+
+      if (slices.empty())
+        return false;
+
+      ArrayType *ayt = ArrayType::get(Type::getInt8PtrTy(ctx), blockAddresses.size());
+      GlobalVariable *table = new GlobalVariable(M, ayt, false,
+                                                 GlobalValue::LinkageTypes::PrivateLinkage,
+                                                 ConstantArray::get(ayt, blockAddresses),
+                                                 "IndirectSwitchTable");
+      appendToCompilerUsed(M, {table});
+
+      for (SwitchSlice &slice : slices) {
+        SwitchInst *si = slice.si;
+        BasicBlock *BB = si->getParent();
+        BasicBlock *defaultDest = si->getDefaultDest();
+        IntegerType *cty = cast<IntegerType>(si->getCondition()->getType());
+
+        if (Morphling::shouldCountSites())
+          counters.push_back(Morphling::countSite(si, slice.site));
+
+        /* edge weights: default first, then one per case */
+        uint64_t defaultWeight = 0, caseWeight = 0;
+        MapVector<BasicBlock *, uint64_t> dests;
+        MDNode *prof = si->getMetadata(LLVMContext::MD_prof);
+        bool weighted = prof && prof->getNumOperands() == si->getNumSuccessors() + 1;
+        if (weighted)
+          defaultWeight = mdconst::extract<ConstantInt>(prof->getOperand(1))->getZExtValue();
+        for (auto c : si->cases()) {
+          uint64_t w = 0;
+          if (weighted)
+            w = mdconst::extract<ConstantInt>(prof->getOperand(c.getSuccessorIndex() + 1))->getZExtValue();
+          dests[c.getCaseSuccessor()] += w;
+          caseWeight += w;
+        }
+        if (PowerOf2Ceil(slice.range) != si->getNumCases())
+          dests.insert({defaultDest, 0});
+
+        /* compared at pointer width at least: a slice may cover all of cty */
+        IntegerType *wty = cty->getBitWidth() < ity->getBitWidth() ? ity : cty;
+        IRBuilder<> irb(si);
+        Value *off = irb.CreateSub(si->getCondition(), ConstantInt::get(cty, slice.low));
+        Morphling::markGenerated(off);
+        Value *inRange = irb.CreateICmpULT(irb.CreateZExt(off, wty), ConstantInt::get(wty, slice.range));
+
+        BasicBlock *lookup = BasicBlock::Create(ctx, "IndirectSwitch", &func, BB->getNextNode());
+        BranchInst *bi = irb.CreateCondBr(inRange, lookup, defaultDest);
+
+        irb.SetInsertPoint(lookup);
+        Value *index = irb.CreateXor(irb.CreateZExtOrTrunc(off, ity), ConstantInt::get(ity, slice.key));
+        Morphling::markGenerated(index);
+        index = irb.CreateAdd(index, ConstantInt::get(ity, slice.base));
+        Morphling::markGenerated(index);
+        Value *gep = irb.CreateGEP(table, {ConstantInt::get(ity, 0), index});
+        LoadInst *li = irb.CreateLoad(gep, "IndirectSwitchTargetAddress");
+        IndirectBrInst *indirBr = irb.CreateIndirectBr(li, dests.size());
+        SmallVector<uint32_t, 16> weights;
+        for (auto &dest : dests) {
+          indirBr->addDestination(dest.first);
+          weights.push_back(std::min<uint64_t>(dest.second, UINT32_MAX));
+        }
+
+        MDBuilder mdb(ctx);
+        if (weighted) {
+          bi->setMetadata(LLVMContext::MD_prof, mdb.createBranchWeights(std::min<uint64_t>(caseWeight, UINT32_MAX),
+                                                                         std::min<uint64_t>(defaultWeight, UINT32_MAX)));
+          indirBr->setMetadata(LLVMContext::MD_prof, mdb.createBranchWeights(weights));
+        }
+
+        /* BB now reaches the default directly and every table entry through lookup */
+        SmallPtrSet<BasicBlock *, 16> succs(succ_begin(si), succ_end(si));
+        for (BasicBlock *succ : succs) {
+          for (PHINode &phi : succ->phis()) {
+            Value *v = phi.getIncomingValueForBlock(BB);
+            while (phi.getBasicBlockIndex(BB) >= 0)
+              phi.removeIncomingValue(BB, false);
+            if (succ == defaultDest)
+              phi.addIncoming(v, BB);
+            if (dests.count(succ))
+              phi.addIncoming(v, lookup);
+          }
+        }
+        /* sub, compare, branch; then xor, add, gep, load, jump */
+        ORE->emit([&]() {
+          return OptimizationRemark(DEBUG_TYPE, "IndirectSwitch", si)
+                 << "switch with " << ore::NV("Cases", si->getNumCases())
+                 << " cases lowered to a " << ore::NV("TableSize", PowerOf2Ceil(slice.range))
+                 << " entry table, cost " << ore::NV("Cost", 8);
+        });
+        si->eraseFromParent();
+      }
+      return true;
+    }
+
     bool runOnFunction(Function &func) override {
       if (!Morphling::toObfuscate(flag, &func, "indibr"))
         return false;
 
-      rp::Value config = Morphling::getConfig("obfuscation.inbobf");
-      if (config.HasMember("inb_rate"))
-        inb_rate = config.FindMember("inb_rate")->value.GetInt();
-      
-      errs() << "Running IndirectBranch On " << func.getName() << "\n";
+      DEBUG(dbgs() << "Running IndirectBranch On " << func.getName() << "\n");
 
       vector<BranchInst *> bis;
+      vector<SwitchInst *> sis;
       for (inst_iterator i = inst_begin(func); i != inst_end(func); i++) {
         BranchInst *bi = dyn_cast<BranchInst>(&(*i));
-        if (bi && bi->isConditional() && !bi->isBogusBranch())
+        if (bi && bi->isConditional() && !Morphling::isBogus(bi))
           bis.push_back(bi);
+        if (SwitchInst *si = dyn_cast<SwitchInst>(&(*i)))
+          sis.push_back(si);
       }
-      return transform(func, bis);
+      OptimizationRemarkEmitter emitter(&func);
+      ORE = &emitter;
+      counters.clear();
+      bool changed = transformSwitches(func, sis);
+      changed = transform(func, bis) || changed;
+      if (!counters.empty())
+        appendToUsed(*func.getParent(), counters);
+      ORE = NULL;
+      return changed;
     }
   };
 }
@@ -0,0 +1,135 @@
+//===----------------------------------------------------------------------------------===//
+// IndirectSwitchCheck: IndirectBranch keeps switches that cover their whole type
+//
+//   IndirectSwitchCheck [-mh_* options]
+//
+// Builds i32 f(i32 x) { switch (trunc x to iN) ... } for a few widths, with a
+// case at both ends of the signed range so the table slice spans every value
+// of iN, then JITs it before and after IndirectBranch and compares the result
+// for every value. Exits non-zero on the first mismatch.
+//===----------------------------------------------------------------------------------===//
+
+#include "llvm/ExecutionEngine/ExecutionEngine.h"
+#include "llvm/ExecutionEngine/MCJIT.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Obfuscation/Morphling.h"
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+using namespace std;
+
+typedef int32_t (*SwitchFn)(int32_t);
+
+/* every even value and the maximum: dense, and from the minimum to the maximum */
+static bool isCase(int32_t v, unsigned bits) {
+  return v % 2 == 0 || v == (1 << (bits - 1)) - 1;
+}
+
+static int32_t expected(int32_t v, unsigned bits) {
+  return isCase(v, bits) ? 10 + (v & 3) : 99;
+}
+
+static std::unique_ptr<Module> buildSwitch(LLVMContext &ctx, unsigned bits) {
+  std::unique_ptr<Module> M(new Module("switch.i" + std::to_string(bits), ctx));
+  IRBuilder<> irb(ctx);
+  Function *F = Function::Create(FunctionType::get(irb.getInt32Ty(), {irb.getInt32Ty()}, false),
+                                 GlobalValue::ExternalLinkage, "f", M.get());
+  IntegerType *cty = irb.getIntNTy(bits);
+
+  BasicBlock *entry = BasicBlock::Create(ctx, "entry", F);
+  BasicBlock *defaultDest = BasicBlock::Create(ctx, "default", F);
+  irb.SetInsertPoint(defaultDest);
+  irb.CreateRet(irb.getInt32(99));
+  BasicBlock *dests[4];
+  for (int i = 0; i < 4; i++) {
+    dests[i] = BasicBlock::Create(ctx, "case" + std::to_string(i), F);
+    irb.SetInsertPoint(dests[i]);
+    irb.CreateRet(irb.getInt32(10 + i));
+  }
+
+  irb.SetInsertPoint(entry);
+  Value *v = irb.CreateTrunc(&*F->arg_begin(), cty);
+  SwitchInst *si = irb.CreateSwitch(v, defaultDest);
+  int32_t low = -(1 << (bits - 1)), high = (1 << (bits - 1)) - 1;
+  for (int32_t c = low; c <= high; c++)
+    if (isCase(c, bits))
+      si->addCase(ConstantInt::get(cty, c, true), dests[c & 3]);
+  return M;
+}
+
+static SwitchFn compile(std::unique_ptr<Module> M, std::vector<std::unique_ptr<ExecutionEngine>> &engines) {
+  std::string error;
+  ExecutionEngine *EE = EngineBuilder(std::move(M)).setEngineKind(EngineKind::JIT)
+                                                   .setErrorStr(&error).create();
+  if (!EE) {
+    errs() << "IndirectSwitchCheck: " << error << "\n";
+    return NULL;
+  }
+  engines.emplace_back(EE);
+  EE->finalizeObject();
+  return (SwitchFn)EE->getFunctionAddress("f");
+}
+
+static bool check(unsigned bits) {
+  LLVMContext ctx;
+  std::vector<std::unique_ptr<ExecutionEngine>> engines;
+
+  std::unique_ptr<Module> M = buildSwitch(ctx, bits);
+  legacy::PassManager PM;
+  PM.add(createIndirectBranchPass(true));
+  PM.run(*M);
+  if (verifyModule(*M, &errs()))
+    return false;
+
+  bool lowered = false;
+  for (BasicBlock &BB : *M->getFunction("f"))
+    lowered |= isa<IndirectBrInst>(BB.getTerminator());
+  if (!lowered) {
+    fprintf(stderr, "IndirectSwitchCheck: i%u switch was not lowered\n", bits);
+    return false;
+  }
+
+  SwitchFn before = compile(buildSwitch(ctx, bits), engines);
+  SwitchFn after = compile(std::move(M), engines);
+  if (!before || !after)
+    return false;
+
+  int32_t low = -(1 << (bits - 1)), high = (1 << (bits - 1)) - 1;
+  for (int32_t v = low; v <= high; v++) {
+    int32_t want = expected(v, bits), a = before(v), b = after(v);
+    if (a != want || b != want) {
+      fprintf(stderr, "IndirectSwitchCheck: i%u %d: want %d, before %d, after %d\n",
+              bits, v, want, a, b);
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  llvm_shutdown_obj Y;
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+
+  /* every switch is a candidate unless the command line says otherwise */
+  std::vector<const char *> args = {argv[0], "-mh_inb_rate=100", "-mh_config_ttl=0"};
+  args.insert(args.end(), argv + 1, argv + argc);
+  cl::ParseCommandLineOptions(args.size(), args.data(), "IndirectBranch full-range switch check\n");
+
+  for (unsigned bits : {4u, 8u, 12u})
+    if (!check(bits))
+      return 1;
+  printf("IndirectSwitchCheck: ok\n");
+  return 0;
+}
@@ -4,9 +4,30 @@
 #include "llvm/rapidjson/stringbuffer.h"
 #include "llvm/rapidjson/writer.h"
 #include <CoreFoundation/CoreFoundation.h>
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Hashing.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/CodeGen/MachineFunction.h"
+#include "llvm/CodeGen/MachineRegisterInfo.h"
+#include "llvm/CodeGen/TargetRegisterInfo.h"
+#include "llvm/CodeGen/TargetSubtargetInfo.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 #include "llvm/Transforms/Obfuscation/Morphling.h"
+#include <atomic>
+#include <ctime>
 #include <fstream>
+#include <memory>
+#include <mutex>
 #include <random>
+#include <unistd.h>
 
 using namespace llvm;
 using namespace std;
@@ -15,6 +36,30 @@ static cl::opt<std::string> AesSeed("aesSeed",
                                     cl::init(""),
                                     cl::desc("seed for the AES-CTR PRNG"));
 
+static cl::opt<bool> CountSites("mh_count_sites",
+                                cl::init(false),
+                                cl::desc("count executions of every obfuscated site"));
+
+static cl::opt<std::string> SiteProfile("mh_site_profile",
+                                        cl::init(""),
+                                        cl::desc("site profile written by SiteProfile"));
+
+static cl::opt<unsigned> SiteHot("mh_site_hot",
+                                 cl::init(100000),
+                                 cl::desc("sites executed this often are left alone"));
+
+static cl::opt<std::string> ConfigSnapshot("mh_config_snapshot",
+                                           cl::init(""),
+                                           cl::desc("config snapshot file (default: per user, in the temp directory)"));
+
+static cl::opt<unsigned> ConfigTTL("mh_config_ttl",
+                                   cl::init(60),
+                                   cl::desc("seconds a config snapshot stays fresh, when written and when read (0: no snapshot)"));
+
+static cl::opt<int> RegisterSeed("mh_register_seed",
+                                 cl::init(0), cl::Hidden,
+                                 cl::desc("allocation order shuffle: 0 as configured, -1 never, else always with this seed"));
+
 
 int Morphling::sendMsg(std::string center, Variant& msg, Variant& output) {
   int status;
@@ -151,6 +196,174 @@ bool Morphling::toObfuscate(bool flag, Function *f, std::string attr) {
 }
 
 
+void Morphling::markBogus(BranchInst *bi, unsigned bogus) {
+  assert(bi->isConditional() && bogus < 2);
+  LLVMContext &ctx = bi->getContext();
+  MDBuilder mdb(ctx);
+  
+  /* never taken: block placement moves the bogus successor out of line */
+  uint32_t weights[2] = {(1u << 20) - 1, (1u << 20) - 1};
+  weights[bogus] = 1;
+  bi->setMetadata(LLVMContext::MD_prof, mdb.createBranchWeights(weights[0], weights[1]));
+  bi->setMetadata("morphling.bogus", MDNode::get(ctx, mdb.createConstant(
+      ConstantInt::get(Type::getInt32Ty(ctx), bogus))));
+}
+
+bool Morphling::isBogus(const Instruction *inst) {
+  return inst->getMetadata("morphling.bogus") != NULL;
+}
+
+/* code the passes add themselves; folded constants are left alone */
+void Morphling::markGenerated(Value *v) {
+  if (Instruction *inst = dyn_cast<Instruction>(v))
+    inst->setMetadata("morphling.gen", MDNode::get(inst->getContext(), None));
+}
+
+bool Morphling::isGenerated(const Instruction *inst) {
+  return inst->getMetadata("morphling.gen") != NULL;
+}
+
+
+/*
+ * stable across builds as long as the pass visits sites in the same order;
+ * passes that run after others skip what isGenerated() reports
+ */
+uint64_t Morphling::siteId(const Function &F, StringRef pass, unsigned ordinal) {
+  MD5 hash;
+  MD5::MD5Result result;
+  hash.update(F.getName());
+  hash.update(pass);
+  hash.update(ArrayRef<uint8_t>((const uint8_t *)&ordinal, sizeof(ordinal)));
+  hash.final(result);
+  return result.low();
+}
+
+/* obfuscation.sites {count, profile, hot} overrides the command line, once */
+static void loadSiteOptions() {
+  static std::once_flag loaded;
+  std::call_once(loaded, [] {
+    rp::Value sites = Morphling::getConfig("obfuscation.sites");
+    if (sites.HasMember("count"))
+      CountSites = sites.FindMember("count")->value.GetBool();
+    if (sites.HasMember("profile"))
+      SiteProfile = sites.FindMember("profile")->value.GetString();
+    if (sites.HasMember("hot"))
+      SiteHot = sites.FindMember("hot")->value.GetUint();
+  });
+}
+
+bool Morphling::shouldCountSites() {
+  loadSiteOptions();
+  return CountSites;
+}
+
+/* one "id count" line per site, id in hex */
+static DenseMap<uint64_t, uint64_t> *loadSiteProfile() {
+  loadSiteOptions();
+  DenseMap<uint64_t, uint64_t> *profile = new DenseMap<uint64_t, uint64_t>();
+  if (SiteProfile.empty())
+    return profile;
+  ErrorOr<std::unique_ptr<MemoryBuffer>> buffer = MemoryBuffer::getFile(SiteProfile);
+  if (!buffer)
+    return profile;
+  SmallVector<StringRef, 0> lines;
+  (*buffer)->getBuffer().split(lines, '\n', -1, false);
+  for (StringRef line : lines) {
+    std::pair<StringRef, StringRef> fields = line.trim().split(' ');
+    uint64_t site, count;
+    if (!fields.first.getAsInteger(16, site) && !fields.second.trim().getAsInteger(10, count))
+      (*profile)[site] += count;
+  }
+  return profile;
+}
+
+bool Morphling::isHotSite(uint64_t id) {
+  static const DenseMap<uint64_t, uint64_t> *profile = loadSiteProfile();
+  auto it = profile->find(id);
+  return it != profile->end() && it->second >= SiteHot;
+}
+
+/* ld64 and ELF linkers both bound a section with symbols of their own */
+static StringRef siteSection(const Triple &T) {
+  return T.isOSBinFormatMachO() ? "__DATA,__mh_sites" : "mh_sites";
+}
+
+static Constant *siteBound(Module &M, bool end) {
+  Triple T(M.getTargetTriple());
+  std::string name = T.isOSBinFormatMachO() ?
+    (end ? "section$end$__DATA$__mh_sites" : "section$start$__DATA$__mh_sites") :
+    (end ? "__stop_mh_sites" : "__start_mh_sites");
+  Type *i8ty = Type::getInt8Ty(M.getContext());
+  if (GlobalVariable *gv = M.getGlobalVariable(name))
+    return gv;
+  GlobalVariable *gv = new GlobalVariable(M, i8ty, false, GlobalValue::ExternalLinkage, NULL, name);
+  gv->setVisibility(GlobalValue::HiddenVisibility);
+  return gv;
+}
+
+/*
+ * int __morphling_sites_dump(const char *path) writes the raw {id, count}
+ * records of the whole image; one copy survives linking.
+ */
+static void emitSiteDump(Module &M) {
+  if (M.getFunction("__morphling_sites_dump"))
+    return;
+  
+  LLVMContext &ctx = M.getContext();
+  const DataLayout &DL = M.getDataLayout();
+  Type *i8pty = Type::getInt8PtrTy(ctx);
+  Type *i32ty = Type::getInt32Ty(ctx);
+  Type *sizety = DL.getIntPtrType(ctx);
+  
+  Constant *fopenFn = M.getOrInsertFunction("fopen", i8pty, i8pty, i8pty);
+  Constant *fwriteFn = M.getOrInsertFunction("fwrite", sizety, i8pty, sizety, sizety, i8pty);
+  Constant *fcloseFn = M.getOrInsertFunction("fclose", i32ty, i8pty);
+  
+  Function *dump = Function::Create(FunctionType::get(i32ty, {i8pty}, false),
+                                    GlobalValue::LinkOnceODRLinkage, "__morphling_sites_dump", &M);
+  dump->setVisibility(GlobalValue::HiddenVisibility);
+  BasicBlock *entry = BasicBlock::Create(ctx, "entry", dump);
+  BasicBlock *write = BasicBlock::Create(ctx, "write", dump);
+  BasicBlock *fail = BasicBlock::Create(ctx, "fail", dump);
+  
+  IRBuilder<> irb(entry);
+  Value *file = irb.CreateCall(fopenFn, {&*dump->arg_begin(), irb.CreateGlobalStringPtr("wb")});
+  irb.CreateCondBr(irb.CreateIsNull(file), fail, write);
+  
+  irb.SetInsertPoint(write);
+  Value *start = siteBound(M, false), *end = siteBound(M, true);
+  Value *size = irb.CreateSub(irb.CreatePtrToInt(end, sizety), irb.CreatePtrToInt(start, sizety));
+  irb.CreateCall(fwriteFn, {start, ConstantInt::get(sizety, 1), size, file});
+  irb.CreateCall(fcloseFn, {file});
+  irb.CreateRet(irb.getInt32(0));
+  
+  irb.SetInsertPoint(fail);
+  irb.CreateRet(irb.getInt32(-1));
+}
+
+/*
+ * {id, count} record in its own section, bumped with a relaxed atomic add;
+ * the caller keeps the records of a function with one appendToUsed, since
+ * every call rebuilds the whole llvm.used array
+ */
+GlobalVariable *Morphling::countSite(Instruction *at, uint64_t id) {
+  Module &M = *at->getModule();
+  Type *i64ty = Type::getInt64Ty(M.getContext());
+  StructType *recty = StructType::get(i64ty, i64ty);
+  Constant *init = ConstantStruct::get(recty, {ConstantInt::get(i64ty, id), ConstantInt::get(i64ty, 0)});
+  GlobalVariable *site = new GlobalVariable(M, recty, false, GlobalValue::PrivateLinkage,
+                                            init, "morphling.site");
+  site->setSection(siteSection(Triple(M.getTargetTriple())));
+  site->setAlignment(8);
+  
+  IRBuilder<> irb(at);
+  irb.CreateAtomicRMW(AtomicRMWInst::Add, irb.CreateStructGEP(recty, site, 1),
+                      irb.getInt64(1), AtomicOrdering::Monotonic);
+  emitSiteDump(M);
+  return site;
+}
+
+
 StringRef Morphling::getPassName() const {
   return StringRef("Morphling");
 }
@@ -172,48 +385,206 @@ std::vector<std::string> Morphling::split(std::string str, std::string pattern)
   return result;
 }
 
-rp::Value Morphling::getConfig(std::string key) {
-  rp::Value null;
-  if (!configs) {
-    Variant packet(rapidjson::kObjectType);
-    Allocator &al = packet.GetAllocator();
-    packet.AddMember("cmd", "config", al);
-    Variant reply;
-    if (Morphling::sendMsg("morphling", packet, reply) == kCFMessagePortSuccess) {
-      configs = new Variant();
-      configs->Swap(reply);
+/*
+ * Config snapshot: a header and the config as JSON, published by the center
+ * or by the first compiler process that fetched it, so a parallel build pays
+ * one round trip and every other process maps the file instead. It is
+ * replaced by rename, so readers see either the old file or the new one.
+ * A reader takes it only when its generation is the one the center reports
+ * now, and when it is younger than the reader's own TTL as well as the
+ * writer's.
+ */
+struct ConfigSnapshotHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t generation; /* of the center's config, 0 if it keeps none */
+  uint64_t written;    /* unix time */
+  uint64_t expires;    /* unix time */
+  uint64_t length;     /* of the JSON that follows */
+};
+
+static const char SnapshotMagic[8] = {'M', 'H', 'C', 'O', 'N', 'F', 'I', 'G'};
+static const uint32_t SnapshotVersion = 2;
+
+/* the cl::opts a fetch reads, copied once per fetch */
+struct SnapshotOptions {
+  std::string path;
+  unsigned ttl;
+};
+
+static SnapshotOptions snapshotOptions() {
+  SnapshotOptions options;
+  options.ttl = ConfigTTL;
+  options.path = ConfigSnapshot;
+  if (options.path.empty()) {
+    SmallString<128> path;
+    sys::path::system_temp_directory(true, path);
+    sys::path::append(path, "morphling-config-" + Twine(getuid()));
+    options.path = path.str();
+  }
+  return options;
+}
+
+/* only a fresh snapshot that this user wrote and nobody else can rewrite */
+static bool readSnapshot(const SnapshotOptions &options, uint64_t generation, Variant &config) {
+  if (!options.ttl)
+    return false;
+  
+  int fd;
+  const std::string &path = options.path;
+  if (sys::fs::openFileForRead(path, fd))
+    return false;
+  
+  bool loaded = false;
+  sys::fs::file_status status;
+  if (!sys::fs::status(fd, status) &&
+      status.getUser() == getuid() &&
+      !(status.permissions() & (sys::fs::group_write | sys::fs::others_write)) &&
+      status.getSize() >= sizeof(ConfigSnapshotHeader)) {
+    std::error_code ec;
+    sys::fs::mapped_file_region region(fd, sys::fs::mapped_file_region::readonly,
+                                       status.getSize(), 0, ec);
+    if (!ec) {
+      ConfigSnapshotHeader header;
+      memcpy(&header, region.const_data(), sizeof(header));
+      uint64_t now = (uint64_t)time(NULL);
+      if (!memcmp(header.magic, SnapshotMagic, sizeof(SnapshotMagic)) &&
+          header.version == SnapshotVersion &&
+          header.generation == generation &&
+          header.written <= now && now - header.written < options.ttl &&
+          header.expires > now &&
+          header.length <= status.getSize() - sizeof(header)) {
+        config.Parse(region.const_data() + sizeof(header), header.length);
+        loaded = !config.HasParseError() && config.IsObject();
+      }
     }
   }
+  close(fd);
+  return loaded;
+}
+
+static void publishSnapshot(const SnapshotOptions &options, uint64_t generation, const Variant &config) {
+  if (!options.ttl)
+    return;
+  
+  rp::StringBuffer buffer;
+  rp::Writer<rp::StringBuffer> writer(buffer);
+  config.Accept(writer);
+  
+  ConfigSnapshotHeader header;
+  memcpy(header.magic, SnapshotMagic, sizeof(SnapshotMagic));
+  header.version = SnapshotVersion;
+  header.reserved = 0;
+  header.generation = generation;
+  header.written = (uint64_t)time(NULL);
+  header.expires = header.written + options.ttl;
+  header.length = buffer.GetSize();
+  
+  int fd;
+  const std::string &path = options.path;
+  SmallString<128> temp;
+  if (sys::fs::createUniqueFile(path + ".%%%%%%", fd, temp,
+                                sys::fs::owner_read | sys::fs::owner_write))
+    return;
+  
+  raw_fd_ostream os(fd, true);
+  os.write((const char *)&header, sizeof(header));
+  os.write(buffer.GetString(), buffer.GetSize());
+  os.close();
+  if (os.has_error()) {
+    os.clear_error();
+    sys::fs::remove(temp);
+    return;
+  }
+  if (sys::fs::rename(temp, path))
+    sys::fs::remove(temp);
+}
+
+/*
+ * Passes may run on several threads (see TsukiOpt), so the fetch and every
+ * copy out of the shared allocator happen under one lock. Only the subtree
+ * asked for is copied.
+ */
+static std::mutex configLock;
+
+/*
+ * One ping, which also says whether the center is there at all; a center
+ * that versions its config puts the generation in the reply.
+ */
+static bool pingCenter(uint64_t &generation) {
+  std::string pong = "pong";
+  generation = 0;
+  Variant packet(rapidjson::kObjectType);
+  Allocator &al = packet.GetAllocator();
+  packet.AddMember("cmd", "ping", al);
+  Variant reply;
+  if (Morphling::sendMsg("morphling", packet, reply) != kCFMessagePortSuccess)
+    return false;
+  if (!reply.IsObject() || !reply.HasMember("cmd") ||
+      !reply.FindMember("cmd")->value.IsString() ||
+      pong.compare(reply.FindMember("cmd")->value.GetString()) != 0)
+    return false;
+  if (reply.HasMember("generation") && reply.FindMember("generation")->value.IsUint64())
+    generation = reply.FindMember("generation")->value.GetUint64();
+  return true;
+}
+
+/*
+ * The snapshot when it is fresh and of the center's current generation, else
+ * one round trip for the config. The generation is taken before the fetch, so
+ * a change in between only costs the next reader a round trip.
+ */
+static void fetchConfigs(const SnapshotOptions &options, Variant *&configs) {
+  if (configs)
+    return;
+  
+  uint64_t generation;
+  if (!pingCenter(generation))
+    return;
+  
+  Variant reply;
+  if (readSnapshot(options, generation, reply)) {
+    configs = new Variant();
+    configs->Swap(reply);
+    return;
+  }
+  
+  Variant packet(rapidjson::kObjectType);
+  Allocator &al = packet.GetAllocator();
+  packet.AddMember("cmd", "config", al);
+  if (Morphling::sendMsg("morphling", packet, reply) == kCFMessagePortSuccess) {
+    configs = new Variant();
+    configs->Swap(reply);
+    if (configs->IsObject())
+      publishSnapshot(options, generation, *configs);
+  }
+}
+
+rp::Value Morphling::getConfig(std::string key) {
+  rp::Value null;
+  std::lock_guard<std::mutex> guard(configLock);
+  if (!configs)
+    fetchConfigs(snapshotOptions(), configs);
   
   if (!configs)
     return null;
   
-  rp::Value config(*configs, configs->GetAllocator());
+  const rp::Value *config = configs;
   std::vector<std::string> paths = split(key, ".");
   for (unsigned i = 0; i < paths.size(); i++) {
-    if (!config.HasMember(paths[i].c_str()))
+    if (!config->IsObject() || !config->HasMember(paths[i].c_str()))
       return null;
-    config = config.FindMember(paths[i].c_str())->value.GetObject();
+    config = &config->FindMember(paths[i].c_str())->value;
   }
   
-  return config;
+  return rp::Value(*config, configs->GetAllocator());
 }
 
+/* always asked: a snapshot outlives the center that wrote it */
 bool Morphling::centerIsAlive() {
-  std::string pong = "pong";
-  bool alive = false;
-  Variant packet(rapidjson::kObjectType);
-  Allocator &al = packet.GetAllocator();
-  packet.AddMember("cmd", "ping", al);
-  Variant reply;
-  int status = Morphling::sendMsg("morphling", packet, reply);
-  if (status == kCFMessagePortSuccess) {
-    if (reply.IsObject() &&
-        reply.HasMember("cmd") &&
-        pong.compare(reply.FindMember("cmd")->value.GetString()) == 0)
-      alive = true;
-  }
-  return alive;
+  uint64_t generation;
+  return pingCenter(generation);
 }
 
 static
@@ -257,12 +628,12 @@ void Morphling::solveFilelist(const char* path) {
   }
 }
 
-static
-bool compare(const Value &L, const Value &R) {
-  return (llvm::cryptoutils->get_range(INT8_MAX) % 2);
-}
-
 void Morphling::solveSymbol(Module &M) {
+  CryptoUtils crypto;
+  auto compare = [&crypto](const Value &L, const Value &R) {
+    return crypto.get_bool(50);
+  };
+  
   M.getGlobalList().sort(compare);
   M.getFunctionList().sort(compare);
   M.getAliasList().sort(compare);
@@ -270,13 +641,73 @@ void Morphling::solveSymbol(Module &M) {
 }
 
 
+/*
+ * Read at first use, not in createMorphlingPass, so creating the pass never
+ * waits on the center; only processes that created it get a seed.
+ */
+static std::atomic<bool> seedWanted(false);
+
+static void loadSeed() {
+  static std::once_flag seeded;
+  if (!seedWanted)
+    return;
+  std::call_once(seeded, [] {
+    if (Morphling::centerIsAlive())
+      Morphling::seed = Morphling::getConfig("obfuscation.seed").GetInt();
+  });
+}
+
+/* the seed to shuffle allocation orders with, 0 to leave them alone */
+static int registerSeed() {
+  if (RegisterSeed)
+    return RegisterSeed < 0 ? 0 : (int)RegisterSeed;
+  loadSeed();
+  if (!Morphling::seed)
+    return 0;
+  rp::Value sortobf = Morphling::getConfig("obfuscation.sortobf");
+  if (!sortobf.HasMember("register") ||
+      !sortobf.FindMember("register")->value.GetBool())
+    return 0;
+  return Morphling::seed;
+}
+
 void Morphling::solveRegister(std::vector<MCPhysReg>& ao) {
-  if (seed) {
-    rp::Value sortobf = Morphling::getConfig("obfuscation.sortobf");
-    if (sortobf.HasMember("register") &&
-        sortobf.FindMember("register")->value.GetBool()) {
-      std::shuffle(ao.begin(), ao.end(), std::default_random_engine(seed));
-    }
+  if (int seed = registerSeed())
+    std::shuffle(ao.begin(), ao.end(), std::default_random_engine(seed));
+}
+
+/*
+ * Callee-saved and caller-saved registers only trade places with their own
+ * kind, each keeping the positions its kind had, so a leaf function never
+ * reaches a callee-saved register any earlier than before and pays no extra
+ * save/restore. The order is seeded per function and per register class.
+ */
+void Morphling::solveRegister(const MachineFunction &MF, std::vector<MCPhysReg>& ao) {
+  int seed = registerSeed();
+  if (!seed)
+    return;
+  
+  const TargetRegisterInfo *TRI = MF.getSubtarget().getRegisterInfo();
+  BitVector saved(TRI->getNumRegs());
+  for (const MCPhysReg *csr = MF.getRegInfo().getCalleeSavedRegs(); csr && *csr; ++csr)
+    for (MCRegAliasIterator ai(*csr, TRI, true); ai.isValid(); ++ai)
+      saved.set(*ai);
+  
+  std::vector<unsigned> positions[2];
+  std::vector<MCPhysReg> regs[2];
+  for (unsigned i = 0; i < ao.size(); i++) {
+    bool group = saved.test(ao[i]);
+    positions[group].push_back(i);
+    regs[group].push_back(ao[i]);
+  }
+  
+  /* the unshuffled order identifies the register class */
+  size_t key = hash_combine(seed, MF.getName(), hash_combine_range(ao.begin(), ao.end()));
+  std::default_random_engine engine(key);
+  for (unsigned group = 0; group < 2; group++) {
+    std::shuffle(regs[group].begin(), regs[group].end(), engine);
+    for (unsigned i = 0; i < positions[group].size(); i++)
+      ao[positions[group][i]] = regs[group][i];
   }
 }
 
@@ -292,15 +723,20 @@ bool Morphling::runOnModule(Module &M) {
   
   rp::Value config = Morphling::getConfig("obfuscation");
   
+  /* one instance, and one seeded CryptoUtils, per module; state is per function */
+  std::unique_ptr<FunctionPass> bcf, fla;
+  if (config.HasMember("bcfobf"))
+    bcf.reset(createBogusControlFlowPass(true));
+  if (config.HasMember("flaobf"))
+    fla.reset(createFlatteningPass(true));
+  
   for (Module::iterator iter = M.begin(); iter != M.end(); iter++) {
     Function &F = *iter;
     if (!F.isDeclaration()) {
-      FunctionPass *P = NULL;
-      if (config.HasMember("bcfobf")) {
-        P = createBogusControlFlowPass(true);
-        P->runOnFunction(F);
-        delete P;
-      }
+      if (bcf)
+        bcf->runOnFunction(F);
+      if (fla)
+        fla->runOnFunction(F);
     }
   }
   
@@ -319,8 +755,7 @@ bool Morphling::runOnModule(Module &M) {
 
 
 ModulePass *llvm::createMorphlingPass() {
-  if (Morphling::centerIsAlive())
-    Morphling::seed = Morphling::getConfig("obfuscation.seed").GetInt();
+  seedWanted = true;
   return new Morphling();
 }
 
@@ -331,6 +766,7 @@ Variant* Morphling::configs = NULL;
 INITIALIZE_PASS_BEGIN(Morphling, "morphling", "Enable Morphling", true, true)
 INITIALIZE_PASS_DEPENDENCY(IndirectBranch);
 INITIALIZE_PASS_DEPENDENCY(BogusControlFlow);
+INITIALIZE_PASS_DEPENDENCY(Flattening);
 INITIALIZE_PASS_DEPENDENCY(StringEncryption);
 INITIALIZE_PASS_DEPENDENCY(Substitution);
 INITIALIZE_PASS_END(Morphling, "morphling", "Enable Morphling", true, true)
@@ -0,0 +1,170 @@
+//===----------------------------------------------------------------------------------===//
+// RegAllocCheck: spills and callee-saved saves with and without sortobf.register
+//
+//   RegAllocCheck [-seed N ...] file.bc ...
+//
+// Each file goes through the target's code generator up to prologue/epilogue
+// insertion, once with the allocation order left alone (-mh_register_seed=-1)
+// and once per seed with it shuffled, as obfuscation.sortobf.register would.
+// Per file and in total it prints the regalloc spill and reload statistics
+// (builds with statistics only; 0 otherwise), the spill slots, and the
+// callee-saved registers saved, read off the MIR. Exits non-zero when any
+// seed changes the number of callee-saved saves of any file.
+//===----------------------------------------------------------------------------------===//
+
+#include "llvm/ADT/Statistic.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TargetRegistry.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+#include "llvm/Transforms/Obfuscation/Morphling.h"
+#include <cinttypes>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+using namespace std;
+
+static cl::list<std::string> InputFiles(cl::Positional, cl::OneOrMore,
+                                        cl::desc("<bitcode files>"));
+
+static cl::list<int> Seeds("seed", cl::ZeroOrMore,
+                           cl::desc("shuffle seeds to compare (default: 1, 2, 3)"));
+
+struct RegAllocCounts {
+  uint64_t spills;
+  uint64_t reloads;
+  uint64_t slots;
+  uint64_t saves;
+};
+
+static uint64_t statistic(const char *name) {
+  std::string json;
+  raw_string_ostream os(json);
+  PrintStatisticsJSON(os);
+  os.flush();
+  Variant stats;
+  stats.Parse(json.c_str());
+  if (stats.HasParseError() || !stats.IsObject() || !stats.HasMember(name))
+    return 0;
+  return stats.FindMember(name)->value.GetUint64();
+}
+
+static bool compile(StringRef path, int seed, RegAllocCounts &counts) {
+  LLVMContext context;
+  SMDiagnostic diag;
+  std::unique_ptr<Module> M = parseIRFile(path, diag, context);
+  if (!M) {
+    fprintf(stderr, "RegAllocCheck: %s: %s\n", path.str().c_str(), diag.getMessage().str().c_str());
+    return false;
+  }
+
+  std::string error;
+  const Target *T = TargetRegistry::lookupTarget(M->getTargetTriple(), error);
+  if (!T) {
+    fprintf(stderr, "RegAllocCheck: %s: %s\n", path.str().c_str(), error.c_str());
+    return false;
+  }
+  std::unique_ptr<TargetMachine> TM(T->createTargetMachine(M->getTargetTriple(), "", "",
+                                                           TargetOptions(), None, None,
+                                                           CodeGenOpt::Default));
+  M->setDataLayout(TM->createDataLayout());
+
+  /* -stop-after=prologepilog: the "assembly" is the MIR right after PEI */
+  SmallString<0> mir;
+  raw_svector_ostream os(mir);
+  legacy::PassManager PM;
+  if (TM->addPassesToEmitFile(PM, os, TargetMachine::CGFT_AssemblyFile)) {
+    fprintf(stderr, "RegAllocCheck: %s: cannot generate code\n", path.str().c_str());
+    return false;
+  }
+
+  *static_cast<cl::opt<int> *>(cl::getRegisteredOptions()["mh_register_seed"]) = seed;
+  uint64_t spills = statistic("regalloc.NumSpills");
+  uint64_t reloads = statistic("regalloc.NumReloads");
+  PM.run(*M);
+  counts.spills = statistic("regalloc.NumSpills") - spills;
+  counts.reloads = statistic("regalloc.NumReloads") - reloads;
+
+  /* every callee-saved register saved has a frame object naming it */
+  counts.slots = counts.saves = 0;
+  SmallVector<StringRef, 0> lines;
+  mir.str().split(lines, '\n');
+  for (StringRef line : lines) {
+    if (line.contains("callee-saved-register:"))
+      counts.saves++;
+    else if (line.contains("type: spill-slot"))
+      counts.slots++;
+  }
+  return true;
+}
+
+static void print(const char *label, const RegAllocCounts &base, const RegAllocCounts &shuffled) {
+  printf("%s: spills %" PRIu64 " -> %" PRIu64 ", reloads %" PRIu64 " -> %" PRIu64
+         ", spill slots %" PRIu64 " -> %" PRIu64 ", callee-saved saves %" PRIu64 " -> %" PRIu64 "\n",
+         label, base.spills, shuffled.spills, base.reloads, shuffled.reloads,
+         base.slots, shuffled.slots, base.saves, shuffled.saves);
+}
+
+int main(int argc, char **argv) {
+  llvm_shutdown_obj Y;
+  InitializeAllTargetInfos();
+  InitializeAllTargets();
+  InitializeAllTargetMCs();
+  InitializeAllAsmPrinters();
+
+  std::vector<const char *> args = {argv[0], "-stop-after=prologepilog"};
+  args.insert(args.end(), argv + 1, argv + argc);
+  cl::ParseCommandLineOptions(args.size(), args.data(), "allocation order shuffle cost check\n");
+  if (!cl::getRegisteredOptions().count("mh_register_seed")) {
+    fprintf(stderr, "RegAllocCheck: not linked against Morphling\n");
+    return 1;
+  }
+  EnableStatistics(false);
+
+  std::vector<int> seeds(Seeds.begin(), Seeds.end());
+  if (seeds.empty())
+    seeds = {1, 2, 3};
+
+  RegAllocCounts total[2] = {};
+  bool changed = false;
+  for (const std::string &path : InputFiles) {
+    RegAllocCounts base;
+    if (!compile(path, -1, base))
+      return 1;
+    for (int seed : seeds) {
+      RegAllocCounts shuffled;
+      if (!compile(path, seed, shuffled))
+        return 1;
+      std::string label = path + " (seed " + std::to_string(seed) + ")";
+      print(label.c_str(), base, shuffled);
+      changed |= shuffled.saves != base.saves;
+
+      total[0].spills += base.spills;
+      total[0].reloads += base.reloads;
+      total[0].slots += base.slots;
+      total[0].saves += base.saves;
+      total[1].spills += shuffled.spills;
+      total[1].reloads += shuffled.reloads;
+      total[1].slots += shuffled.slots;
+      total[1].saves += shuffled.saves;
+    }
+  }
+  print("total", total[0], total[1]);
+
+  if (changed) {
+    fprintf(stderr, "RegAllocCheck: the shuffle changed callee-saved saves\n");
+    return 1;
+  }
+  return 0;
+}
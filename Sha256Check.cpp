@@ -0,0 +1,145 @@
+//===----------------------------------------------------------------------------------===//
+// Sha256Check: known answers for every SHA-256 entry point in CryptoUtils
+//
+//   Sha256Check
+//
+// The FIPS 180-2 vectors (and the empty message) go through the one-shot
+// sha256, through sha256_multi in batches of 1, 2, 8, 9 and 17 with the
+// vectors rotated across lanes, and through raw_sha256_ostream written in
+// chunks of several sizes. Messages of 0..130 bytes, every padding case, are
+// then hashed in one mixed batch and checked against the stream fed a byte
+// at a time. Whatever backend this machine selects is the one checked.
+// Exits non-zero on the first mismatch.
+//===----------------------------------------------------------------------------------===//
+
+#include "llvm/Transforms/Obfuscation/CryptoUtils.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+struct KnownAnswer {
+  std::string msg;
+  const char *digest;
+};
+
+static std::vector<KnownAnswer> knownAnswers() {
+  return {
+    {"", "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"},
+    {"abc", "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"},
+    {"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+     "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1"},
+    {"abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmnhijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu",
+     "cf5b16a778af8380036ce59e7b0492370b249b11e8f07a51afac45037afee9d1"},
+    {std::string(1000000, 'a'), "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0"},
+  };
+}
+
+static std::string hex(const unsigned char *hash) {
+  static const char digits[] = "0123456789abcdef";
+  std::string out;
+  for (int i = 0; i < 32; i++) {
+    out += digits[hash[i] >> 4];
+    out += digits[hash[i] & 15];
+  }
+  return out;
+}
+
+static bool expect(const char *api, size_t len, const unsigned char *hash, const std::string &want) {
+  if (hex(hash) == want)
+    return true;
+  fprintf(stderr, "Sha256Check: %s, %zu bytes: want %s, got %s\n",
+          api, len, want.c_str(), hex(hash).c_str());
+  return false;
+}
+
+static void streamed(const std::string &msg, size_t chunk, unsigned char *hash) {
+  raw_sha256_ostream os;
+  for (size_t at = 0; at < msg.size(); at += chunk)
+    os.write(msg.data() + at, std::min(chunk, msg.size() - at));
+  os.final(hash);
+}
+
+static bool checkOneShot(CryptoUtils &crypto, const std::vector<KnownAnswer> &kats) {
+  unsigned char hash[32];
+  for (const KnownAnswer &kat : kats) {
+    crypto.sha256(kat.msg.c_str(), hash);
+    if (!expect("sha256", kat.msg.size(), hash, kat.digest))
+      return false;
+  }
+  return true;
+}
+
+static bool checkMulti(CryptoUtils &crypto, const std::vector<KnownAnswer> &kats) {
+  for (unsigned count : {1u, 2u, 8u, 9u, 17u}) {
+    for (unsigned shift = 0; shift < kats.size(); shift++) {
+      std::vector<const unsigned char *> msgs;
+      std::vector<size_t> lens;
+      std::vector<const KnownAnswer *> wants;
+      for (unsigned i = 0; i < count; i++) {
+        const KnownAnswer &kat = kats[(i + shift) % kats.size()];
+        msgs.push_back((const unsigned char *)kat.msg.data());
+        lens.push_back(kat.msg.size());
+        wants.push_back(&kat);
+      }
+      std::vector<unsigned char> hashes(32 * count);
+      crypto.sha256_multi(msgs.data(), lens.data(), count, hashes.data());
+      for (unsigned i = 0; i < count; i++)
+        if (!expect("sha256_multi", lens[i], &hashes[32 * i], wants[i]->digest))
+          return false;
+    }
+  }
+  return true;
+}
+
+static bool checkStream(const std::vector<KnownAnswer> &kats) {
+  unsigned char hash[32];
+  for (const KnownAnswer &kat : kats)
+    for (size_t chunk : {1, 3, 55, 64, 65, 4096}) {
+      streamed(kat.msg, chunk, hash);
+      if (!expect("raw_sha256_ostream", kat.msg.size(), hash, kat.digest))
+        return false;
+    }
+  return true;
+}
+
+/* 0..130 bytes: short, 55/56 and 63/64/65 around the padding, two blocks and more */
+static bool checkMixed(CryptoUtils &crypto) {
+  std::vector<std::string> texts;
+  for (size_t len = 0; len <= 130; len++) {
+    std::string text(len, 0);
+    for (size_t i = 0; i < len; i++)
+      text[i] = (char)(i * 131 + len);
+    texts.push_back(text);
+  }
+
+  std::vector<const unsigned char *> msgs;
+  std::vector<size_t> lens;
+  for (const std::string &text : texts) {
+    msgs.push_back((const unsigned char *)text.data());
+    lens.push_back(text.size());
+  }
+  std::vector<unsigned char> hashes(32 * texts.size());
+  crypto.sha256_multi(msgs.data(), lens.data(), texts.size(), hashes.data());
+
+  unsigned char hash[32];
+  for (size_t i = 0; i < texts.size(); i++) {
+    streamed(texts[i], 1, hash);
+    if (!expect("sha256_multi (mixed batch)", lens[i], &hashes[32 * i], hex(hash)))
+      return false;
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  CryptoUtils crypto;
+  std::vector<KnownAnswer> kats = knownAnswers();
+  if (!checkOneShot(crypto, kats) || !checkMulti(crypto, kats) ||
+      !checkStream(kats) || !checkMixed(crypto))
+    return 1;
+  printf("Sha256Check: ok\n");
+  return 0;
+}
@@ -0,0 +1,64 @@
+//===----------------------------------------------------------------------------------===//
+// SiteProfile: merge __morphling_sites_dump files into a site profile
+//
+//   SiteProfile out.profile dump1 [dump2 ...]
+//
+// Each dump is the raw {uint64 id, uint64 count} records of one run, in the
+// byte order of the machine that wrote it. Counts of the same site are summed
+// and written as "id count" lines (id in hex), hottest first, for
+// -mh_site_profile / obfuscation.sites.profile.
+//===----------------------------------------------------------------------------------===//
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <map>
+#include <utility>
+#include <vector>
+
+struct SiteRecord {
+  uint64_t id;
+  uint64_t count;
+};
+
+static bool merge(const char *path, std::map<uint64_t, uint64_t> &counts) {
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    fprintf(stderr, "SiteProfile: cannot open %s\n", path);
+    return false;
+  }
+  SiteRecord record;
+  while (fread(&record, sizeof(record), 1, file) == 1)
+    counts[record.id] += record.count;
+  fclose(file);
+  return true;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s out.profile dump...\n", argv[0]);
+    return 1;
+  }
+
+  std::map<uint64_t, uint64_t> counts;
+  for (int i = 2; i < argc; i++)
+    if (!merge(argv[i], counts))
+      return 1;
+
+  std::vector<std::pair<uint64_t, uint64_t>> sites(counts.begin(), counts.end());
+  std::stable_sort(sites.begin(), sites.end(),
+                   [](const std::pair<uint64_t, uint64_t> &l,
+                      const std::pair<uint64_t, uint64_t> &r) {
+                     return l.second > r.second;
+                   });
+
+  FILE *out = fopen(argv[1], "w");
+  if (!out) {
+    fprintf(stderr, "SiteProfile: cannot write %s\n", argv[1]);
+    return 1;
+  }
+  for (auto &site : sites)
+    fprintf(out, "%016" PRIx64 " %" PRIu64 "\n", site.first, site.second);
+  fclose(out);
+  return 0;
+}
@@ -4,7 +4,16 @@
 #include <map>
 #include <set>
 #include <string>
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/IR/CallSite.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Debug.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
@@ -30,124 +39,120 @@ upper("strcry_upper",
       cl::value_desc("strcry_upper"), cl::init(90),
       cl::Optional);
 
+static cl::opt<int>
+maxSize("strcry_max",
+        cl::desc("largest constant (in bytes) collected for encryption"),
+        cl::value_desc("strcry_max"), cl::init(1 << 20),
+        cl::Optional);
+
+static cl::opt<bool>
+ondemand("strcry_ondemand",
+         cl::desc("keep strings read-only and decode them into the user's frame"),
+         cl::value_desc("strcry_ondemand"), cl::init(false),
+         cl::Optional);
+
+static cl::opt<int>
+ondemandMax("strcry_ondemand_max",
+            cl::desc("largest string (in bytes) decoded on demand"),
+            cl::value_desc("strcry_ondemand_max"), cl::init(256),
+            cl::Optional);
+
+static cl::opt<int>
+threads("strcry_threads",
+        cl::desc("threads decoding the string table at startup (above 1, the image must link pthreads)"),
+        cl::value_desc("strcry_threads"), cl::init(1),
+        cl::Optional);
+
+static cl::opt<int>
+threadsMin("strcry_threads_min",
+           cl::desc("fewer strings than this are decoded on one thread"),
+           cl::value_desc("strcry_threads_min"), cl::init(65536),
+           cl::Optional);
+
+
+/* applied word-wise; the low byte of a word result is the byte result */
+typedef uint32_t (*EncryptFn)(uint32_t v, uint32_t k);
+
+static uint32_t encXor(uint32_t v, uint32_t k) { return v ^ k; }
+static uint32_t encAdd(uint32_t v, uint32_t k) { return v + k; }
+static uint32_t encSub(uint32_t v, uint32_t k) { return v - k; }
+
+static const EncryptFn encBox[] = {encXor, encAdd, encSub};
+
+/* k has the width of v: i32 for whole words, i8 for the tail */
+typedef Value *(*DecryptFn)(IRBuilder<> &builder, Value *v, Value *k);
+
+static Value *decXor(IRBuilder<> &builder, Value *v, Value *k) { return builder.CreateXor(v, k); }
+static Value *decSub(IRBuilder<> &builder, Value *v, Value *k) { return builder.CreateSub(v, k); }
+static Value *decAdd(IRBuilder<> &builder, Value *v, Value *k) { return builder.CreateAdd(v, k); }
+
+/* decBox[i] undoes encBox[i] */
+static const DecryptFn decBox[] = {decXor, decSub, decAdd};
+
+static_assert(array_lengthof(encBox) == array_lengthof(decBox), "unpaired string box");
+
+namespace {
+  /* the strcry_* options with obfuscation.strcry applied */
+  struct StrcryOptions {
+    int lower;
+    int upper;
+    int maxSize;
+    bool ondemand;
+    int ondemandMax;
+    int threads;
+    int threadsMin;
+  };
+}
+
+static StrcryOptions loadStrcryOptions() {
+  StrcryOptions options = {lower, upper, maxSize, ondemand, ondemandMax, threads, threadsMin};
+  rp::Value config = Morphling::getConfig("obfuscation.strcry");
+
+  if (config.HasMember("lower"))
+    options.lower = config.FindMember("lower")->value.GetInt();
+  
+  if (config.HasMember("upper"))
+    options.upper = config.FindMember("upper")->value.GetInt();
+  
+  if (config.HasMember("max"))
+    options.maxSize = config.FindMember("max")->value.GetInt();
+  
+  if (config.HasMember("ondemand"))
+    options.ondemand = config.FindMember("ondemand")->value.GetBool();
+  
+  if (config.HasMember("ondemand_max"))
+    options.ondemandMax = config.FindMember("ondemand_max")->value.GetInt();
+  
+  if (config.HasMember("threads"))
+    options.threads = config.FindMember("threads")->value.GetInt();
+  
+  if (config.HasMember("threads_min"))
+    options.threadsMin = config.FindMember("threads_min")->value.GetInt();
+  
+  return options;
+}
+
+/*
+ * The config is fetched once per process, so the options are read once; the
+ * cl::opts are never written, and passes on other threads see the same copy.
+ */
+static const StrcryOptions &strcryOptions() {
+  static const StrcryOptions options = loadStrcryOptions();
+  return options;
+}
 
 StringEncryption::StringEncryption() : ModulePass(ID), decoder(NULL) {
   this->flag = true;
-  initBox();
 }
 
 StringEncryption::StringEncryption(bool flag) : ModulePass(ID), decoder(NULL) {
   this->flag = flag;
-  initBox();
 }
 
 StringRef StringEncryption::getPassName() const {
   return StringRef("StringEncryption");
 }
 
-void StringEncryption::initBox() {
-  encBox = {
-    /* box 0  */
-    [](StringEncryption* pass,
-       StringRef snippet,
-       uint8_t& seed) {
-      char* buf = const_cast<char*>(snippet.data());
-      unsigned size = snippet.size();
-      uint8_t last = seed;
-      for (unsigned i = 0; i != size; ++i) {
-        seed ^= buf[i];
-        buf[i] = last;
-        last = seed;
-      }
-    },
-    /* box 1 */
-    [](StringEncryption* pass,
-       StringRef snippet,
-       uint8_t& seed){
-      char* buf = const_cast<char*>(snippet.data());
-      unsigned size = snippet.size();
-      for (unsigned i = 0; i != size; ++i) {
-        buf[i] += 1;
-      }
-    },
-    /* box 2 */
-    [](StringEncryption* pass,
-       StringRef snippet,
-       uint8_t& seed){
-      char* buf = const_cast<char*>(snippet.data());
-      unsigned size = snippet.size();
-      for (unsigned i = 0; i != size; ++i) {
-        buf[i] -= 1;
-        seed -= 1;  /* confuse seed */
-      }
-    }
-  };
-  
-  decBox = {
-    /* box 0  */
-    [](StringEncryption* pass,
-       IRBuilder<>& builder,
-       Value* pstr, PHINode* i, Value* pseed,
-       BasicBlock* exit){
-      /* xor */
-      Value *index = i;
-      Value *getchar = builder.CreateGEP(pstr, ArrayRef<Value*>(&index, 1));
-      LoadInst *ori = builder.CreateLoad(getchar, false, "ori");
-      Value *res = builder.CreateXor(ori, builder.CreateLoad(pseed), "res");
-      builder.CreateStore(ori, pseed, false);
-      builder.CreateStore(res, getchar, false);
-      
-      /* update i */
-      Value *subi = builder.CreateSub(i, ConstantInt::get(pass->ity, 1));
-      Value *cmpi = builder.CreateICmpSGE(subi, ConstantInt::get(pass->ity, 0));
-      BasicBlock* block = builder.GetInsertBlock();
-      builder.CreateCondBr(cmpi, block, exit);
-      i->addIncoming(subi, block);
-    },
-    /* box 1  */
-    [](StringEncryption* pass,
-       IRBuilder<>& builder,
-       Value* pstr, PHINode* i, Value* pseed,
-       BasicBlock* exit){
-      /* sub */
-      Value *index = i;
-      Value *getchar = builder.CreateGEP(pstr, ArrayRef<Value*>(&index, 1));
-      LoadInst *ori = builder.CreateLoad(getchar, false, "ori");
-      Value *res = builder.CreateSub(ori, ConstantInt::get(pass->i8ty, 1));
-      builder.CreateStore(res, getchar, false);
-      
-      /* update i */
-      Value *subi = builder.CreateSub(i, ConstantInt::get(pass->ity, 1));
-      Value *cmpi = builder.CreateICmpSGE(subi, ConstantInt::get(pass->ity, 0));
-      BasicBlock* block = builder.GetInsertBlock();
-      builder.CreateCondBr(cmpi, block, exit);
-      i->addIncoming(subi, block);
-    },
-    /* box 2  */
-    [](StringEncryption* pass,
-       IRBuilder<>& builder,
-       Value* pstr, PHINode* i, Value* pseed,
-       BasicBlock* exit){
-      /* add */
-      Value *index = i;
-      Value *getchar = builder.CreateGEP(pstr, ArrayRef<Value*>(&index, 1));
-      LoadInst *ori = builder.CreateLoad(getchar, false, "ori");
-      Value *res = builder.CreateAdd(ori, ConstantInt::get(pass->i8ty, 1));
-      Value *seed = builder.CreateLoad(pseed);
-      seed = builder.CreateAdd(seed, ConstantInt::get(pass->i8ty, 1));
-      builder.CreateStore(res, getchar, false);
-      builder.CreateStore(seed, pseed, false);
-      
-      /* update i */
-      Value *subi = builder.CreateSub(i, ConstantInt::get(pass->ity, 1));
-      Value *cmpi = builder.CreateICmpSGE(subi, ConstantInt::get(pass->ity, 0));
-      BasicBlock* block = builder.GetInsertBlock();
-      builder.CreateCondBr(cmpi, block, exit);
-      i->addIncoming(subi, block);
-    }
-  };
-}
-
 void StringEncryption::initializeType(Module &M) {
   LLVMContext & ctx = M.getContext();
   const DataLayout layout = M.getDataLayout();
@@ -160,47 +165,151 @@ void StringEncryption::initializeType(Module &M) {
 bool StringEncryption::runOnModule(Module &M) {
   if (!flag) return false;
   
-  rp::Value config = Morphling::getConfig("obfuscation.strcry");
-
-  if (config.HasMember("lower"))
-    lower = config.FindMember("lower")->value.GetInt();
-  
-  if (config.HasMember("upper"))
-  upper = config.FindMember("upper")->value.GetInt();
-  
   bool changed = false;
   initializeType(M);
   
   vector<GlobalVariable *> gvs;
   unsigned count = collectString(M, gvs);
-  errs() << "collect string count:" << count << "\n";
+  DEBUG(dbgs() << "collect string count:" << count << "\n");
+  (void)count;
   
-  Constant* table = transform(M, gvs, seed);
+  Constant* table = transform(M, gvs, key);
   if (table) {
-    decoder = createDecoder(M, (ConstantArray*)table, seed);
+    decoder = createDecoder(M, (ConstantArray*)table, key);
     changed = true;
   }
   return changed;
 }
 
+/* integers and padding-free arrays/structs of them: every byte is data */
+static bool isPlainData(const DataLayout &DL, Type *ty) {
+  if (IntegerType *ity = dyn_cast<IntegerType>(ty))
+    return ity->getBitWidth() % 8 == 0 && ity->getBitWidth() <= 64;
+  
+  if (ArrayType *aty = dyn_cast<ArrayType>(ty)) {
+    Type *ety = aty->getElementType();
+    return DL.getTypeStoreSize(ety) == DL.getTypeAllocSize(ety) && isPlainData(DL, ety);
+  }
+  
+  if (StructType *sty = dyn_cast<StructType>(ty)) {
+    uint64_t size = 0;
+    for (Type *ety : sty->elements()) {
+      if (!isPlainData(DL, ety))
+        return false;
+      size += DL.getTypeAllocSize(ety);
+    }
+    return size == DL.getTypeAllocSize(sty);
+  }
+  return false;
+}
+
+/*
+ * sections the loader or the ObjC runtime read before any initializer, and
+ * the embedded bitcode and command line (__LLVM,__bitcode, .llvmbc, ...)
+ */
+static bool isRuntimeSection(StringRef section) {
+  std::string folded = section.lower();
+  StringRef name(folded);
+  return name.startswith("llvm.") || name.startswith(".llvm") ||
+         name.find("__objc_") != StringRef::npos ||
+         name.find("__llvm") != StringRef::npos;
+}
+
+/* -fembed-bitcode globals, whatever section the target gives them */
+static bool isEmbeddedGlobal(const GlobalVariable *gv) {
+  return gv->getName() == "llvm.embedded.module" || gv->getName() == "llvm.cmdline";
+}
+
+static void storeInt(const DataLayout &DL, char *out, uint64_t v, unsigned size) {
+  for (unsigned b = 0; b < size; b++)
+    out[DL.isLittleEndian() ? b : size - 1 - b] = v >> (8 * b);
+}
+
+static uint64_t loadInt(const DataLayout &DL, const char *in, unsigned size) {
+  uint64_t v = 0;
+  for (unsigned b = 0; b < size; b++)
+    v |= (uint64_t)(uint8_t)in[DL.isLittleEndian() ? b : size - 1 - b] << (8 * b);
+  return v;
+}
+
+/* lay the initializer out as the target will, bytes in target order */
+static bool flatten(const DataLayout &DL, Constant *C, char *out) {
+  if (isa<ConstantAggregateZero>(C))
+    return true;
+  
+  if (ConstantInt *ci = dyn_cast<ConstantInt>(C)) {
+    storeInt(DL, out, ci->getZExtValue(), DL.getTypeStoreSize(ci->getType()));
+    return true;
+  }
+  
+  if (ConstantDataSequential *cds = dyn_cast<ConstantDataSequential>(C)) {
+    if (!cds->getElementType()->isIntegerTy())
+      return false;
+    unsigned per = cds->getElementByteSize();
+    for (unsigned i = 0; i < cds->getNumElements(); i++)
+      storeInt(DL, out + i * per, cds->getElementAsInteger(i), per);
+    return true;
+  }
+  
+  if (ConstantArray *ca = dyn_cast<ConstantArray>(C)) {
+    uint64_t per = DL.getTypeAllocSize(ca->getType()->getElementType());
+    for (unsigned i = 0; i < ca->getNumOperands(); i++)
+      if (!flatten(DL, ca->getOperand(i), out + i * per))
+        return false;
+    return true;
+  }
+  
+  if (ConstantStruct *cs = dyn_cast<ConstantStruct>(C)) {
+    const StructLayout *layout = DL.getStructLayout(cs->getType());
+    for (unsigned i = 0; i < cs->getNumOperands(); i++)
+      if (!flatten(DL, cs->getOperand(i), out + layout->getElementOffset(i)))
+        return false;
+    return true;
+  }
+  return false;
+}
+
+static Constant *rebuild(const DataLayout &DL, Type *ty, const char *in) {
+  if (IntegerType *ity = dyn_cast<IntegerType>(ty))
+    return ConstantInt::get(ity, loadInt(DL, in, DL.getTypeStoreSize(ity)));
+  
+  vector<Constant *> elements;
+  if (ArrayType *aty = dyn_cast<ArrayType>(ty)) {
+    Type *ety = aty->getElementType();
+    uint64_t per = DL.getTypeAllocSize(ety);
+    for (uint64_t i = 0; i < aty->getNumElements(); i++)
+      elements.push_back(rebuild(DL, ety, in + i * per));
+    /* folds back into a ConstantDataArray for integer elements */
+    return ConstantArray::get(aty, elements);
+  }
+  
+  StructType *sty = cast<StructType>(ty);
+  const StructLayout *layout = DL.getStructLayout(sty);
+  for (unsigned i = 0; i < sty->getNumElements(); i++)
+    elements.push_back(rebuild(DL, sty->getElementType(i), in + layout->getElementOffset(i)));
+  return ConstantStruct::get(sty, elements);
+}
+
 unsigned StringEncryption::collectString(Module &M, vector<GlobalVariable *> &gvs) {
-  /* find constant string */
+  const DataLayout &DL = M.getDataLayout();
+  
+  /* find constant data: strings of any width, integer tables, records of integers */
   for (Module::global_iterator gi = M.global_begin(); gi != M.global_end(); ++gi) {
     GlobalVariable* gv = &(*gi);
-    std::string section(gv->getSection());
-    std::string name = gv->getName().str();
     
     /* filter */
-    if (name.substr(0,4) != ".str") continue;
-    if (section == "llvm.metadata") continue;
     if (!gv->isConstant()) continue;
     if (!gv->hasInitializer()) continue;
+    if (!gv->hasLocalLinkage()) continue;
+    if (gv->isThreadLocal()) continue;
+    if (isRuntimeSection(gv->getSection())) continue;
+    if (isEmbeddedGlobal(gv)) continue;
     
-    Constant *init = gv->getInitializer();
-    ConstantDataSequential *cdata = dyn_cast<ConstantDataSequential>(init);
+    Type *ty = gv->getValueType();
+    if (!isPlainData(DL, ty)) continue;
     
-    if (!cdata) continue;
-    if (!cdata->getElementType()->isIntegerTy()) continue;
+    uint64_t size = DL.getTypeAllocSize(ty);
+    if (size < 2 || size > (uint64_t)strcryOptions().maxSize) continue;
     
     gvs.push_back(gv);
   }
@@ -218,56 +327,442 @@ Fixup MakeFixup(GlobalVariable *gv, int type, unsigned offset, unsigned size) {
   return fix;
 }
 
-Constant *StringEncryption::transform(Module &M, vector<GlobalVariable *> &gvs, uint8_t &seed) {
+/*
+ * Keystream: the per-string key is four speck-like ARX rounds over the module
+ * key and the fixup index; the stream itself is xorshift32 seeded with it,
+ * one 32-bit word per step.
+ */
+static uint32_t deriveKey(uint32_t key, uint32_t index) {
+  uint32_t x = index, y = key;
+  for (uint32_t r = 0; r < 4; r++) {
+    x = ((x >> 8) | (x << 24)) + y;
+    x ^= key + r;
+    y = ((y << 3) | (y >> 29)) ^ x;
+  }
+  /* xorshift never leaves zero */
+  return y | 1;
+}
+
+static uint32_t nextKey(uint32_t &x) {
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return x;
+}
+
+static Value *emitDeriveKey(IRBuilder<> &builder, Value *key, Value *index) {
+  Value *x = index, *y = key;
+  for (uint32_t r = 0; r < 4; r++) {
+    x = builder.CreateOr(builder.CreateLShr(x, 8), builder.CreateShl(x, 24));
+    x = builder.CreateAdd(x, y);
+    x = builder.CreateXor(x, builder.CreateAdd(key, builder.getInt32(r)));
+    y = builder.CreateOr(builder.CreateShl(y, 3), builder.CreateLShr(y, 29));
+    y = builder.CreateXor(y, x);
+  }
+  return builder.CreateOr(y, builder.getInt32(1));
+}
+
+static Value *emitNextKey(IRBuilder<> &builder, Value *x) {
+  x = builder.CreateXor(x, builder.CreateShl(x, 13));
+  x = builder.CreateXor(x, builder.CreateLShr(x, 17));
+  x = builder.CreateXor(x, builder.CreateShl(x, 5));
+  return x;
+}
+
+/* word loads follow the target's byte order, not the host's */
+static void encrypt(StringEncryption *pass, int box, char *buf, unsigned size,
+                    uint32_t key, bool little) {
+  unsigned char *p = (unsigned char *)buf;
+  uint32_t x = key;
+  unsigned words = size / 4;
+  for (unsigned w = 0; w < words; w++, p += 4) {
+    uint32_t v = little ?
+      (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24) :
+      (p[3] | p[2] << 8 | p[1] << 16 | (uint32_t)p[0] << 24);
+    v = encBox[box](v, nextKey(x));
+    for (unsigned b = 0; b < 4; b++)
+      p[little ? b : 3 - b] = v >> (8 * b);
+  }
+  
+  if (size % 4 == 0)
+    return;
+  uint32_t k = nextKey(x);
+  for (unsigned i = words * 4; i < size; i++, k >>= 8)
+    buf[i] = encBox[box]((uint8_t)buf[i], k);
+}
+
+/* the address must not outlive the frame the string is decoded into */
+static bool isFrameLocalUse(Use &U) {
+  User *user = U.getUser();
+  
+  if (ConstantExpr *ce = dyn_cast<ConstantExpr>(user)) {
+    if (ce->getOpcode() != Instruction::GetElementPtr &&
+        ce->getOpcode() != Instruction::BitCast)
+      return false;
+    for (Use &CU : ce->uses())
+      if (!isFrameLocalUse(CU))
+        return false;
+    return true;
+  }
+  
+  Instruction *inst = dyn_cast<Instruction>(user);
+  if (!inst || isa<PHINode>(inst))
+    return false;
+  
+  if (isa<LoadInst>(inst))
+    return true;
+  
+  if (isa<GetElementPtrInst>(inst) || isa<BitCastInst>(inst)) {
+    for (Use &IU : inst->uses())
+      if (!isFrameLocalUse(IU))
+        return false;
+    return true;
+  }
+  
+  CallSite CS(inst);
+  if (CS && CS.isArgOperand(&U))
+    return CS.doesNotCapture(CS.getArgumentNo(&U));
+  return false;
+}
+
+static bool canDecodeOnDemand(GlobalVariable *gv, unsigned size) {
+  if (size > (unsigned)strcryOptions().ondemandMax)
+    return false;
+  if (gv->use_empty())
+    return false;
+  for (Use &U : gv->uses())
+    if (!isFrameLocalUse(U))
+      return false;
+  return true;
+}
+
+/* turn constant expressions over the string into instructions at their users */
+static void expandConstantExpr(ConstantExpr *ce) {
+  SmallSetVector<ConstantExpr *, 4> nested;
+  for (User *user : ce->users())
+    if (ConstantExpr *expr = dyn_cast<ConstantExpr>(user))
+      nested.insert(expr);
+  for (ConstantExpr *expr : nested)
+    expandConstantExpr(expr);
+  
+  vector<Use *> uses;
+  for (Use &U : ce->uses())
+    uses.push_back(&U);
+  for (Use *U : uses) {
+    Instruction *user = cast<Instruction>(U->getUser());
+    Instruction *inst = ce->getAsInstruction();
+    inst->insertBefore(user);
+    U->set(inst);
+  }
+  ce->destroyConstant();
+}
+
+/* decodes size bytes at pstr with box; falls through to exit */
+static void emitDecodeLoop(StringEncryption *pass, IRBuilder<> &builder, unsigned box,
+                           Value *pstr, Value *size, Value *key, BasicBlock *exit) {
+  LLVMContext &ctx = builder.getContext();
+  BasicBlock *entry = builder.GetInsertBlock();
+  Function *fun = entry->getParent();
+  Type *i32ty = builder.getInt32Ty();
+  Type *i32pty = i32ty->getPointerTo();
+  
+  Value *zero = ConstantInt::get(pass->ity, 0);
+  Value *one = ConstantInt::get(pass->ity, 1);
+  Value *words = builder.CreateLShr(size, 2);
+  
+  BasicBlock* head = BasicBlock::Create(ctx, "", fun);
+  BasicBlock* body = BasicBlock::Create(ctx, "", fun);
+  BasicBlock* rest = BasicBlock::Create(ctx, "", fun);
+  BasicBlock* tail = BasicBlock::Create(ctx, "", fun);
+  builder.CreateBr(head);
+  
+  /* init w, x(phi) */
+  builder.SetInsertPoint(head);
+  PHINode *w = builder.CreatePHI(pass->ity, 2, "w");
+  PHINode *x = builder.CreatePHI(i32ty, 2, "x");
+  w->addIncoming(zero, entry);
+  x->addIncoming(key, entry);
+  builder.CreateCondBr(builder.CreateICmpULT(w, words), body, rest);
+  
+  /* one word per keystream step */
+  builder.SetInsertPoint(body);
+  Value *nx = emitNextKey(builder, x);
+  Value *offset = builder.CreateShl(w, 2);
+  Value *getword = builder.CreateBitCast(builder.CreateGEP(pstr, offset), i32pty);
+  LoadInst *ori = builder.CreateLoad(getword, "ori");
+  ori->setAlignment(1);
+  Value *res = decBox[box](builder, ori, nx);
+  builder.CreateStore(res, getword)->setAlignment(1);
+  w->addIncoming(builder.CreateAdd(w, one), body);
+  x->addIncoming(nx, body);
+  builder.CreateBr(head);
+  
+  /* bytes after the last whole word share one more keystream word */
+  builder.SetInsertPoint(rest);
+  Value *begin = builder.CreateShl(words, 2);
+  Value *tk = emitNextKey(builder, x);
+  builder.CreateCondBr(builder.CreateICmpULT(begin, size), tail, exit);
+  
+  builder.SetInsertPoint(tail);
+  PHINode *i = builder.CreatePHI(pass->ity, 2, "i");
+  PHINode *k = builder.CreatePHI(i32ty, 2, "k");
+  i->addIncoming(begin, rest);
+  k->addIncoming(tk, rest);
+  Value *getchar = builder.CreateGEP(pstr, i);
+  LoadInst *chr = builder.CreateLoad(getchar, "chr");
+  res = decBox[box](builder, chr, builder.CreateTrunc(k, pass->i8ty));
+  builder.CreateStore(res, getchar);
+  Value *nexti = builder.CreateAdd(i, one);
+  i->addIncoming(nexti, tail);
+  k->addIncoming(builder.CreateLShr(k, 8), tail);
+  builder.CreateCondBr(builder.CreateICmpULT(nexti, size), tail, exit);
+}
+
+static Value *emitInfoSize(StringEncryption *pass, IRBuilder<> &builder, Value *info) {
+  Value *mask = ConstantInt::get(pass->ity, ~(0xfull << (pass->bitSize-4)));
+  return builder.CreateAnd(info, mask);
+}
+
+/* box taken from the info word at run time */
+static void emitDispatcher(StringEncryption *pass, IRBuilder<> &builder,
+                           Value *pstr, Value *info, Value *key,
+                           BasicBlock *exit) {
+  LLVMContext &ctx = builder.getContext();
+  Function *fun = builder.GetInsertBlock()->getParent();
+  
+  Value *size = emitInfoSize(pass, builder, info);
+  Value *type = builder.CreateLShr(info, pass->bitSize-4);
+  SwitchInst* sw = builder.CreateSwitch(type, exit);
+  
+  for (unsigned idx = 0; idx < array_lengthof(decBox); idx++) {
+    BasicBlock* box = BasicBlock::Create(ctx, "box", fun);
+    sw->addCase(ConstantInt::get(pass->ity, idx), box);
+    builder.SetInsertPoint(box);
+    emitDecodeLoop(pass, builder, idx, pstr, size, key, exit);
+  }
+}
+
+/* void (i8 *str, iN info, i32 key): decodes one string in place */
+static Function *getOnDemandDecoder(StringEncryption *pass, Module &M) {
+  const char *name = "strcry.ondemand";
+  if (Function *fun = M.getFunction(name))
+    return fun;
+  
+  LLVMContext &ctx = M.getContext();
+  Type *params[] = {pass->i8pty, pass->ity, Type::getInt32Ty(ctx)};
+  FunctionType *fty = FunctionType::get(Type::getVoidTy(ctx), params, false);
+  Function *fun = Function::Create(fty, GlobalValue::PrivateLinkage, name, &M);
+  fun->setCallingConv(CallingConv::C);
+  /* inlined into a user, the decode would constant fold back to plaintext */
+  fun->addFnAttr(Attribute::NoInline);
+  
+  Function::arg_iterator args = fun->arg_begin();
+  Value *pstr = &*args++;
+  Value *info = &*args++;
+  Value *key = &*args++;
+  
+  BasicBlock *entry = BasicBlock::Create(ctx, "entry", fun);
+  BasicBlock *leave = BasicBlock::Create(ctx, "leave", fun);
+  
+  IRBuilder<> builder(entry);
+  emitDispatcher(pass, builder, pstr, info, key, leave);
+  
+  builder.SetInsertPoint(leave);
+  builder.CreateRetVoid();
+  return fun;
+}
+
+/*
+ * The string stays encrypted in read-only memory; every function using it
+ * copies the ciphertext into a stack buffer and decodes it there, so the
+ * buffer lives exactly as long as the frame that reads it. Uses in dead
+ * blocks never read it and do not place the decode; a decode that would land
+ * in a loop goes up to a block before its outermost loop, so it runs once
+ * per call.
+ */
+static void decodeOnDemand(StringEncryption *pass, Module &M, GlobalVariable *gv,
+                           int type, unsigned offset, unsigned size, uint32_t key) {
+  SmallSetVector<ConstantExpr *, 4> ces;
+  for (User *user : gv->users())
+    if (ConstantExpr *ce = dyn_cast<ConstantExpr>(user))
+      ces.insert(ce);
+  for (ConstantExpr *ce : ces)
+    expandConstantExpr(ce);
+  
+  MapVector<Function *, SmallVector<Instruction *, 4>> sites;
+  for (User *user : gv->users()) {
+    Instruction *inst = cast<Instruction>(user);
+    sites[inst->getFunction()].push_back(inst);
+  }
+  
+  Function *dec = getOnDemandDecoder(pass, M);
+  uint64_t bytes = M.getDataLayout().getTypeAllocSize(gv->getValueType());
+  Value *info = ConstantInt::get(pass->ity, ((uint64_t)type << (pass->bitSize - 4)) | size);
+  
+  for (auto &site : sites) {
+    Function *F = site.first;
+    SmallPtrSet<Instruction *, 4> users(site.second.begin(), site.second.end());
+    
+    IRBuilder<> builder(&*F->getEntryBlock().getFirstInsertionPt());
+    AllocaInst *buf = builder.CreateAlloca(gv->getValueType(), 0, "strcry.buf");
+    
+    /* decode once, right before the first use that dominates the others */
+    DominatorTree DT(*F);
+    BasicBlock *bb = NULL;
+    for (Instruction *inst : site.second) {
+      if (!DT.isReachableFromEntry(inst->getParent()))
+        continue;
+      bb = bb ? DT.findNearestCommonDominator(bb, inst->getParent()) : inst->getParent();
+    }
+    
+    if (bb) {
+      LoopInfo LI(DT);
+      bool hoisted = false;
+      while (LI.getLoopFor(bb)) {
+        Loop *L = LI.getLoopFor(bb);
+        while (L->getParentLoop())
+          L = L->getParentLoop();
+        bb = DT.getNode(L->getHeader())->getIDom()->getBlock();
+        hoisted = true;
+      }
+      
+      Instruction *at = bb->getTerminator();
+      if (!hoisted) {
+        for (Instruction &inst : *bb) {
+          if (users.count(&inst)) {
+            at = &inst;
+            break;
+          }
+        }
+      }
+      
+      builder.SetInsertPoint(at);
+      Value *dst = builder.CreateBitCast(buf, pass->i8pty);
+      Value *src = builder.CreateBitCast(gv, pass->i8pty);
+      builder.CreateMemCpy(dst, src, bytes, 1);
+      Value *str = builder.CreateGEP(dst, ConstantInt::get(pass->ity, offset));
+      Value *args[] = {str, info, builder.getInt32(key)};
+      builder.CreateCall(dec, args);
+    }
+    
+    for (Instruction *inst : site.second)
+      inst->replaceUsesOfWith(gv, buf);
+  }
+}
+
+/* the first instruction reaching gv, through constant expressions */
+static Instruction *firstUser(Value *V) {
+  for (User *U : V->users()) {
+    if (Instruction *inst = dyn_cast<Instruction>(U))
+      return inst;
+    if (isa<ConstantExpr>(U))
+      if (Instruction *inst = firstUser(U))
+        return inst;
+  }
+  return NULL;
+}
+
+/* reported at a use; cost is one decode op per word plus one per tail byte */
+static void remarkString(GlobalVariable *gv, unsigned osize, unsigned esize, bool local) {
+  Instruction *inst = firstUser(gv);
+  if (!inst)
+    return;
+  OptimizationRemarkEmitter ORE(inst->getFunction());
+  ORE.emit([&]() {
+    return OptimizationRemark(DEBUG_TYPE, local ? "DecodedOnDemand" : "DecodedAtLoad", inst)
+           << "encrypted " << ore::NV("String", gv->getName())
+           << " (" << ore::NV("Encrypted", esize) << " of " << ore::NV("Size", osize)
+           << " bytes), cost " << ore::NV("Cost", esize / 4 + esize % 4);
+  });
+}
+
+Constant *StringEncryption::transform(Module &M, vector<GlobalVariable *> &gvs, uint32_t &key) {
   vector<Fixup> fixups;
-  seed = llvm::cryptoutils->get_range(UINT8_MAX);
+  vector<pair<Fixup, vector<char>>> pending;
+  const DataLayout &DL = M.getDataLayout();
+  bool little = DL.isLittleEndian();
+  key = crypto.get_uint32_t();
   
   for (GlobalVariable *gv : gvs) {
     Constant *init = gv->getInitializer();
-    ConstantDataSequential *cdata = dyn_cast<ConstantDataSequential>(init);
-    unsigned per = cdata->getElementByteSize();
-    
-    /* filter empty string */
-    unsigned count = cdata->getNumElements();
-    if (count <= 1) continue;
+    Type* ty = init->getType();
     
     /* create copy */
-    StringRef ori = cdata->getRawDataValues();
-    unsigned osize = per * count;
-    vector<char> buf(ori.begin(), ori.end());
+    unsigned osize = DL.getTypeAllocSize(ty);
+    vector<char> buf(osize, 0);
+    if (!flatten(DL, init, buf.data())) continue;
     
     /* calculating range */
     /* [lower,upper] */
-    float percent = (lower + (cryptoutils->get_range(INT16_MAX) % (upper-lower+1))) / 100.f;
+    const StrcryOptions &options = strcryOptions();
+    unsigned percent = options.lower + crypto.choose(options.upper - options.lower + 1);
     
-    unsigned esize = floor(osize * percent);
+    unsigned esize = (uint64_t)osize * percent / 100;
     if (esize == 0) continue;
     
     unsigned offset = osize - esize;
     if (offset != 0)
-      offset = cryptoutils->get_range(INT32_MAX) % offset;
+      offset = crypto.choose(offset);
+    
+    bool local = options.ondemand && canDecodeOnDemand(gv, osize);
+    int index = crypto.choose(array_lengthof(encBox));
+    
+    /* table strings are keyed by their final table index, see below */
+    if (!local) {
+      pending.push_back({MakeFixup(gv, index, offset, esize), std::move(buf)});
+      continue;
+    }
+    
+    uint32_t skey = crypto.get_uint32_t() | 1;
+    encrypt(this, index, buf.data() + offset, esize, skey, little);
+    
+    Constant* replace = rebuild(DL, ty, buf.data());
+    remarkString(gv, osize, esize, local);
+    
+    /* keep ciphertext read-only, out of the cstring literal sections */
+    gv->setInitializer(replace);
+    gv->setSection("");
+    decodeOnDemand(this, M, gv, index, offset, esize, skey);
+  }
+  
+  /*
+   * Grouped by box, then in module order (the order the globals are laid
+   * out), so the decoder runs one loop per box over a contiguous table
+   * range and touches the strings front to back.
+   */
+  std::stable_sort(pending.begin(), pending.end(),
+                   [](const pair<Fixup, vector<char>> &l, const pair<Fixup, vector<char>> &r) {
+                     return l.first.type < r.first.type;
+                   });
+  
+  for (auto &item : pending) {
+    Fixup &fix = item.first;
+    GlobalVariable *gv = fix.gv;
+    Type *ty = gv->getValueType();
+    vector<char> &buf = item.second;
+    
+    uint32_t skey = deriveKey(key, fixups.size());
+    encrypt(this, fix.type, buf.data() + fix.offset, fix.size, skey, little);
     
-    int index = cryptoutils->get_range(INT16_MAX) % encBox.size();
-    encBox.at(index)(this, StringRef(buf.data() + offset, esize), seed);
+    Constant* replace = rebuild(DL, ty, buf.data());
+    remarkString(gv, buf.size(), fix.size, false);
     
     /* replace and fix string writable */
-    Type* ty = cdata->getType();
-    Constant* replace = ConstantDataArray::getImpl(StringRef(buf.data(), buf.size()), ty);
     gv->setConstant(false);
     gv->setInitializer(replace);
     gv->setSection("");
     
-    fixups.push_back(MakeFixup(gv, index, offset, esize));
+    fixups.push_back(fix);
   }
   
   /* nothing to be done */
   if (0 == fixups.size())
     return NULL;
   
-  return createTable(M, fixups, seed);
+  return createTable(M, fixups);
 }
 
-Constant* StringEncryption::createTable(Module &M, std::vector<Fixup> &fixups, uint8_t seed) {
+Constant* StringEncryption::createTable(Module &M, std::vector<Fixup> &fixups) {
   vector<Type *> types;
   types.push_back(i8pty);
   types.push_back(ity);
@@ -281,7 +776,7 @@ Constant* StringEncryption::createTable(Module &M, std::vector<Fixup> &fixups, u
     Constant* offset = ConstantInt::get(ity, fix.offset);
     Constant* ngv = ConstantExpr::getAdd(gv, offset);
     ngv = ConstantExpr::getIntToPtr(ngv, i8pty);
-    Constant* info = ConstantInt::get(ity, (fix.type << (bitSize - 4)) | fix.size);
+    Constant* info = ConstantInt::get(ity, ((uint64_t)fix.type << (bitSize - 4)) | fix.size);
     vector<Constant *> cs = {ngv, info};
     Constant* item = ConstantStruct::get(fixty, ArrayRef<Constant *>(cs));
     items.push_back(item);
@@ -301,7 +796,147 @@ static llvm::Function *GetPrintfDeclaration(llvm::Module &M) {
   return llvm::Function::Create(funcT, llvm::GlobalVariable::ExternalLinkage, "printf", &M);
 }
 
-Function* StringEncryption::createDecoder(Module &M, ConstantArray* array, uint8_t seed) {
+/* [begin, end) of each box in the grouped table, read back from the info words */
+typedef pair<unsigned, pair<uint64_t, uint64_t>> BoxGroup;
+
+static vector<BoxGroup> tableGroups(StringEncryption *pass, ConstantArray *array) {
+  vector<BoxGroup> groups;
+  for (unsigned i = 0; i < array->getNumOperands(); i++) {
+    ConstantStruct *item = cast<ConstantStruct>(array->getOperand(i));
+    uint64_t info = cast<ConstantInt>(item->getOperand(1))->getZExtValue();
+    unsigned type = info >> (pass->bitSize - 4);
+    if (groups.empty() || groups.back().first != type)
+      groups.push_back({type, {i, i}});
+    groups.back().second.second = i + 1;
+  }
+  return groups;
+}
+
+/* one forward loop per box over its part of [sb, se), no dispatch per string */
+static void emitDecodeRange(StringEncryption *pass, IRBuilder<> &builder, GlobalVariable *table,
+                            vector<BoxGroup> &groups, uint32_t key, Value *sb, Value *se) {
+  LLVMContext &ctx = builder.getContext();
+  Function *fun = builder.GetInsertBlock()->getParent();
+  Value *one = ConstantInt::get(pass->ity, 1);
+  
+  for (auto &group : groups) {
+    Value *begin = ConstantInt::get(pass->ity, group.second.first);
+    Value *end = ConstantInt::get(pass->ity, group.second.second);
+    Value *lo = builder.CreateSelect(builder.CreateICmpUGT(sb, begin), sb, begin);
+    Value *hi = builder.CreateSelect(builder.CreateICmpULT(se, end), se, end);
+    
+    BasicBlock *pre = builder.GetInsertBlock();
+    BasicBlock *forJbody = BasicBlock::Create(ctx, "forJbody", fun);
+    BasicBlock *forJend = BasicBlock::Create(ctx, "forJend", fun);
+    BasicBlock *next = BasicBlock::Create(ctx, "next", fun);
+    builder.CreateCondBr(builder.CreateICmpULT(lo, hi), forJbody, next);
+    
+    /* init j(phi) */
+    builder.SetInsertPoint(forJbody);
+    PHINode *j = builder.CreatePHI(pass->ity, 2, "j");
+    j->addIncoming(lo, pre);
+    
+    Value *strIndex[3] = {builder.getInt32(0), j, builder.getInt32(0)};
+    Value *getpstr = builder.CreateGEP(table, ArrayRef<Value*>(strIndex, 3));
+    LoadInst *pstr = builder.CreateLoad(getpstr);
+    Value *infoIndex[3] = {builder.getInt32(0), j, builder.getInt32(1)};
+    Value *getpinfo = builder.CreateGEP(table, ArrayRef<Value*>(infoIndex, 3));
+    Value *info = builder.CreateLoad(getpinfo, "info");
+    
+    Value *skey = emitDeriveKey(builder, builder.getInt32(key),
+                                builder.CreateTrunc(j, builder.getInt32Ty()));
+    emitDecodeLoop(pass, builder, group.first, pstr, emitInfoSize(pass, builder, info),
+                   skey, forJend);
+    
+    /* update j */
+    builder.SetInsertPoint(forJend);
+    Value *addj = builder.CreateAdd(j, one);
+    j->addIncoming(addj, forJend);
+    builder.CreateCondBr(builder.CreateICmpULT(addj, hi), forJbody, next);
+    
+    builder.SetInsertPoint(next);
+  }
+}
+
+/*
+ * Slices are contiguous index ranges of the whole table and may straddle
+ * box groups; strings are keyed by index alone, so slices share no state.
+ * Slice 0 runs on the calling thread, the rest on short-lived pthreads that
+ * are joined before the guard is released; a slice whose thread could not
+ * be created runs inline.
+ */
+static void emitThreads(StringEncryption *pass, Module &M, IRBuilder<> &builder,
+                        Function *slice, unsigned nthreads) {
+  LLVMContext &ctx = M.getContext();
+  Function *fun = builder.GetInsertBlock()->getParent();
+  Type *i32ty = builder.getInt32Ty();
+  Type *tidty = pass->ity;
+  
+  Constant *create = M.getOrInsertFunction("pthread_create", i32ty, tidty->getPointerTo(),
+                                           pass->i8pty, slice->getType(), pass->i8pty);
+  Constant *join = M.getOrInsertFunction("pthread_join", i32ty, tidty,
+                                         pass->i8pty->getPointerTo());
+  
+  IRBuilder<> entry(&*fun->getEntryBlock().getFirstInsertionPt());
+  AllocaInst *tids = entry.CreateAlloca(tidty, entry.getInt32(nthreads), "strcry.tids");
+  AllocaInst *started = entry.CreateAlloca(builder.getInt1Ty(), entry.getInt32(nthreads),
+                                           "strcry.started");
+  Value *null = ConstantPointerNull::get(cast<PointerType>(pass->i8pty));
+  
+  for (unsigned s = 1; s < nthreads; s++) {
+    Value *arg = builder.CreateIntToPtr(ConstantInt::get(pass->ity, s), pass->i8pty);
+    Value *tid = builder.CreateGEP(tids, builder.getInt32(s));
+    Value *rc = builder.CreateCall(create, {tid, null, slice, arg});
+    Value *ok = builder.CreateICmpEQ(rc, builder.getInt32(0));
+    builder.CreateStore(ok, builder.CreateGEP(started, builder.getInt32(s)));
+    
+    BasicBlock *serial = BasicBlock::Create(ctx, "serial", fun);
+    BasicBlock *next = BasicBlock::Create(ctx, "spawned", fun);
+    builder.CreateCondBr(ok, next, serial);
+    builder.SetInsertPoint(serial);
+    builder.CreateCall(slice, {arg});
+    builder.CreateBr(next);
+    builder.SetInsertPoint(next);
+  }
+  
+  builder.CreateCall(slice, {builder.CreateIntToPtr(ConstantInt::get(pass->ity, 0), pass->i8pty)});
+  
+  for (unsigned s = 1; s < nthreads; s++) {
+    BasicBlock *joining = BasicBlock::Create(ctx, "join", fun);
+    BasicBlock *next = BasicBlock::Create(ctx, "joined", fun);
+    Value *ok = builder.CreateLoad(builder.CreateGEP(started, builder.getInt32(s)));
+    builder.CreateCondBr(ok, joining, next);
+    builder.SetInsertPoint(joining);
+    Value *tid = builder.CreateLoad(builder.CreateGEP(tids, builder.getInt32(s)));
+    builder.CreateCall(join, {tid, ConstantPointerNull::get(pass->i8pty->getPointerTo())});
+    builder.CreateBr(next);
+    builder.SetInsertPoint(next);
+  }
+}
+
+/* i8 *(i8 *s): decodes [count * s / n, count * (s + 1) / n) */
+static Function *createSlice(StringEncryption *pass, Module &M, GlobalVariable *table,
+                             vector<BoxGroup> &groups, uint32_t key, uint64_t count,
+                             unsigned nthreads) {
+  LLVMContext &ctx = M.getContext();
+  Type *i8pty = pass->i8pty;
+  Type *ity = pass->ity;
+  FunctionType *fty = FunctionType::get(i8pty, {i8pty}, false);
+  Function *fun = Function::Create(fty, GlobalValue::PrivateLinkage, "strcry.slice", &M);
+  fun->setCallingConv(CallingConv::C);
+  
+  IRBuilder<> builder(BasicBlock::Create(ctx, "entry", fun));
+  Value *s = builder.CreatePtrToInt(&*fun->arg_begin(), ity);
+  Value *total = ConstantInt::get(ity, count);
+  Value *n = ConstantInt::get(ity, nthreads);
+  Value *sb = builder.CreateUDiv(builder.CreateMul(total, s), n);
+  Value *se = builder.CreateUDiv(builder.CreateMul(total, builder.CreateAdd(s, ConstantInt::get(ity, 1))), n);
+  emitDecodeRange(pass, builder, table, groups, key, sb, se);
+  builder.CreateRet(ConstantPointerNull::get(cast<PointerType>(i8pty)));
+  return fun;
+}
+
+Function* StringEncryption::createDecoder(Module &M, ConstantArray* array, uint32_t key) {
   LLVMContext & ctx = M.getContext();
   FunctionType* fty = FunctionType::get(Type::getVoidTy(ctx), {}, false);
   GlobalValue::LinkageTypes lktype = GlobalValue::LinkageTypes::PrivateLinkage;
@@ -311,17 +946,17 @@ Function* StringEncryption::createDecoder(Module &M, ConstantArray* array, uint8
   Function* fun = Function::Create(fty, lktype, "", &M);
   fun->setCallingConv(CallingConv::C);
   
-  /* constant */
-  Value *zero = ConstantInt::get(ity, 0);
-  Value *one = ConstantInt::get(ity, 1);
-  Value *mask = ConstantInt::get(ity, ~(0xfull << (bitSize-4)));
+  /* decode state: 0 idle, 1 decoding, 2 done */
+  GlobalVariable *guard = new GlobalVariable(M, i8ty, false, lktype,
+                                             ConstantInt::get(i8ty, 0), "strcry.guard");
   
   /* create block */
   BasicBlock* entry = BasicBlock::Create(ctx, "entry", fun);
+  BasicBlock* claim = BasicBlock::Create(ctx, "claim", fun);
+  BasicBlock* wait = BasicBlock::Create(ctx, "wait", fun);
+  BasicBlock* decode = BasicBlock::Create(ctx, "decode", fun);
+  BasicBlock* finish = BasicBlock::Create(ctx, "finish", fun);
   BasicBlock* leave = BasicBlock::Create(ctx, "leave", fun);
-  BasicBlock* forJbody = BasicBlock::Create(ctx, "forJbody", fun);
-  BasicBlock* forJend = BasicBlock::Create(ctx, "forJend", fun);
-  BasicBlock* dispatcher = BasicBlock::Create(ctx, "dispatcher", fun);
   
   IRBuilder<> builder(entry);
   
@@ -334,51 +969,48 @@ Function* StringEncryption::createDecoder(Module &M, ConstantArray* array, uint8
   builder.CreateCall(printf,  ArrayRef<Value*>(args, 2));
    */
 
-  /* init local variable */
-  AllocaInst* pseed = builder.CreateAlloca(i8ty, 0, "pseed");
-  builder.CreateStore(builder.getInt8(seed), pseed);
-  
-  /* goto begin */
-  builder.CreateBr(forJbody);
-  /* init j(phi) */
-  builder.SetInsertPoint(forJbody);
-  PHINode *j = builder.CreatePHI(ity, 2, "j");
-  Value *jbegin = ConstantInt::get(ity, array->getType()->getNumElements() - 1);
-  j->addIncoming(jbegin, entry);
-  
-  /* update local variable */
-  Value *strIndex[3] = {builder.getInt32(0), j, builder.getInt32(0)};
-  Value *getpstr = builder.CreateGEP(table, ArrayRef<Value*>(strIndex, 3));
-  LoadInst *pstr = builder.CreateLoad(getpstr);
-  Value *infoIndex[3] = {builder.getInt32(0), j, builder.getInt32(1)};
-  Value *getpinfo = builder.CreateGEP(table, ArrayRef<Value*>(infoIndex, 3));
-  Value *info = builder.CreateLoad(getpinfo, "info");
-  /* goto switch */
-  builder.CreateBr(dispatcher);
-  
-  /* restore */
-  builder.SetInsertPoint(dispatcher);
-  Value *size = builder.CreateAnd(info, mask);
-  size = builder.CreateSub(size, one);
-  Value *type = builder.CreateLShr(info, bitSize-4);
-  SwitchInst* sw = builder.CreateSwitch(type, forJend);
-  
-  for (unsigned idx = 0; idx < decBox.size(); idx++) {
-    BasicBlock* block = BasicBlock::Create(ctx, "", fun);
-    builder.SetInsertPoint(block);
-    /* init i(phi) */
-    PHINode *i = builder.CreatePHI(ity, 2, "i");
-    i->addIncoming(size, dispatcher);
-    decBox.at(idx)(this, builder, pstr, i, pseed, forJend);
-    sw->addCase(ConstantInt::get(ity, idx), block);
+  /* fast path: already decoded */
+  LoadInst *state = builder.CreateLoad(guard, "state");
+  state->setAtomic(AtomicOrdering::Acquire);
+  state->setAlignment(1);
+  builder.CreateCondBr(builder.CreateICmpEQ(state, builder.getInt8(2)), leave, claim);
+  
+  /* only the first caller decodes */
+  builder.SetInsertPoint(claim);
+  Value *owner = builder.CreateAtomicCmpXchg(guard, builder.getInt8(0), builder.getInt8(1),
+                                             AtomicOrdering::AcquireRelease,
+                                             AtomicOrdering::Acquire);
+  builder.CreateCondBr(builder.CreateExtractValue(owner, 1), decode, wait);
+  
+  /* everyone else waits for it to finish */
+  builder.SetInsertPoint(wait);
+  state = builder.CreateLoad(guard, "state");
+  state->setAtomic(AtomicOrdering::Acquire);
+  state->setAlignment(1);
+  builder.CreateCondBr(builder.CreateICmpEQ(state, builder.getInt8(2)), leave, wait);
+  
+  vector<BoxGroup> groups = tableGroups(this, array);
+  uint64_t count = array->getNumOperands();
+  unsigned nthreads = std::max(strcryOptions().threads, 1);
+  if (count < (uint64_t)strcryOptions().threadsMin || count < nthreads)
+    nthreads = 1;
+  
+  builder.SetInsertPoint(decode);
+  if (nthreads == 1) {
+    emitDecodeRange(this, builder, table, groups, key,
+                    ConstantInt::get(ity, 0), ConstantInt::get(ity, count));
+  } else {
+    Function *slice = createSlice(this, M, table, groups, key, count, nthreads);
+    emitThreads(this, M, builder, slice, nthreads);
   }
+  builder.CreateBr(finish);
   
-  /* update j */
-  builder.SetInsertPoint(forJend);
-  Value *subj = builder.CreateSub(j, one);
-  j->addIncoming(subj, forJend);
-  Value *cmpj = builder.CreateICmpSGE(subj, zero);
-  builder.CreateCondBr(cmpj, forJbody, leave);
+  /* publish the decoded strings */
+  builder.SetInsertPoint(finish);
+  StoreInst *done = builder.CreateStore(builder.getInt8(2), guard);
+  done->setAtomic(AtomicOrdering::Release);
+  done->setAlignment(1);
+  builder.CreateBr(leave);
   
   builder.SetInsertPoint(leave);
   builder.CreateRetVoid();
@@ -1,10 +1,18 @@
 
 #include "llvm/Transforms/Obfuscation/Substitution.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/InstIterator.h"
 #include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include "llvm/Transforms/Obfuscation/Morphling.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 
 #define DEBUG_TYPE "substitution"
 
@@ -21,140 +29,231 @@ sub_rate("sub_prob",
             cl::desc("this don't tell you"),
             cl::value_desc("this don't tell you"), cl::init(50), cl::Optional);
 
+static cl::opt<bool>
+sub_late("sub_late",
+         cl::desc("schedule substitution after the vectorizers"),
+         cl::value_desc("sub_late"), cl::init(true), cl::Optional);
 
 namespace {
 
+  /*
+   * sub_loop / sub_prob with obfuscation.subobf applied, read once per process
+   * at the first function; all is whether obfuscation.subobf is present.
+   */
+  struct SubOptions {
+    int rounds;
+    unsigned rate;
+    bool all;
+  };
+
+  const SubOptions &subOptions() {
+    static const SubOptions options = [] {
+      SubOptions options = {sub_time, sub_rate, false};
+      rp::Value config = Morphling::getConfig("obfuscation.subobf");
+      options.all = config.IsObject();
+      if (config.HasMember("sub_rate"))
+        options.rate = config.FindMember("sub_rate")->value.GetInt();
+      if (config.HasMember("sub_loop"))
+        options.rounds = config.FindMember("sub_loop")->value.GetInt();
+      return options;
+    }();
+    return options;
+  }
+
+  struct Substitution;
+  typedef void (*Rewrite)(Substitution *pass, BinaryOperator *bo);
+
+  /* a + b = a - (-b) */
+  void addNeg(Substitution *pass, BinaryOperator *bo) {
+    assert(bo->getOpcode() == Instruction::Add);
+    BinaryOperator *op = NULL;
+    op = BinaryOperator::CreateNeg(bo->getOperand(1), "", bo);
+    op = BinaryOperator::Create(Instruction::Sub, bo->getOperand(0), op, "", bo);
+    bo->replaceAllUsesWith(op);
+  }
+
+  /* a + b = -(-a + (-b)) */
+  void addDoubleNeg(Substitution *pass, BinaryOperator *bo) {
+    assert(bo->getOpcode() == Instruction::Add);
+    BinaryOperator *op, *op2 = NULL;
+    op = BinaryOperator::CreateNeg(bo->getOperand(0), "", bo);
+    op2 = BinaryOperator::CreateNeg(bo->getOperand(1), "", bo);
+    op = BinaryOperator::Create(Instruction::Add, op, op2, "", bo);
+    op = BinaryOperator::CreateNeg(op, "", bo);
+    bo->replaceAllUsesWith(op);
+  }
+
+  /* a + b = a - r + b + r, r from the pass's per-function constants */
+  void addRand(Substitution *pass, BinaryOperator *bo);
+
+  /* a - b = a + (-b) */
+  void subNeg(Substitution *pass, BinaryOperator *bo) {
+    assert(bo->getOpcode() == Instruction::Sub);
+    BinaryOperator *op = NULL;
+    op = BinaryOperator::CreateNeg(bo->getOperand(1), "", bo);
+    op = BinaryOperator::Create(Instruction::Add, bo->getOperand(0), op, "", bo);
+    bo->replaceAllUsesWith(op);
+  }
+
+  /* a - b = -(b - a) */
+  void subSwap(Substitution *pass, BinaryOperator *bo) {
+    assert(bo->getOpcode() == Instruction::Sub);
+    BinaryOperator *op = NULL;
+    op = BinaryOperator::Create(Instruction::Sub, bo->getOperand(1), bo->getOperand(0), "", bo);
+    op = BinaryOperator::CreateNeg(op, "", bo);
+    bo->replaceAllUsesWith(op);
+  }
+
+  /* a & b = b & a */
+  void andSwap(Substitution *pass, BinaryOperator *bo) {
+    assert(bo->getOpcode() == Instruction::And);
+    BinaryOperator *op = NULL;
+    op = BinaryOperator::Create(Instruction::And, bo->getOperand(1), bo->getOperand(0), "", bo);
+    bo->replaceAllUsesWith(op);
+  }
+
+  /* a & b == (a^~b) & a */
+  void andXorNot(Substitution *pass, BinaryOperator *bo) {
+    assert(bo->getOpcode() == Instruction::And);
+    BinaryOperator *op, *op2 = NULL;
+    op = BinaryOperator::CreateNot(bo->getOperand(1), "", bo);
+    op2 = BinaryOperator::Create(Instruction::Xor, bo->getOperand(0), op, "", bo);
+    op = BinaryOperator::Create(Instruction::And, op2, bo->getOperand(0), "", bo);
+    bo->replaceAllUsesWith(op);
+  }
+
+  /* a | b = b | a */
+  void orSwap(Substitution *pass, BinaryOperator *bo) {
+    assert(bo->getOpcode() == Instruction::Or);
+    BinaryOperator *op = NULL;
+    op = BinaryOperator::Create(Instruction::Or, bo->getOperand(1), bo->getOperand(0), "", bo);
+    bo->replaceAllUsesWith(op);
+  }
+
+  /* a | b = (a & b) | (a ^ b) */
+  void orAndXor(Substitution *pass, BinaryOperator *bo) {
+    assert(bo->getOpcode() == Instruction::Or);
+    BinaryOperator *op, *op1 = NULL;
+    op = BinaryOperator::Create(Instruction::And, bo->getOperand(0), bo->getOperand(1), "", bo);
+    op1 = BinaryOperator::Create(Instruction::Xor, bo->getOperand(0), bo->getOperand(1), "", bo);
+    op = BinaryOperator::Create(Instruction::Or, op, op1, "", bo);
+    bo->replaceAllUsesWith(op);
+  }
+
+  /* a ^ b = b ^ a */
+  void xorSwap(Substitution *pass, BinaryOperator *bo) {
+    assert(bo->getOpcode() == Instruction::Xor);
+    BinaryOperator *op = NULL;
+    op = BinaryOperator::Create(Instruction::Xor, bo->getOperand(1), bo->getOperand(0), "", bo);
+    bo->replaceAllUsesWith(op);
+  }
+
+  /* a ~ b => a = (!a && b) | (a && !b) */
+  void xorAndNot(Substitution *pass, BinaryOperator *bo) {
+    assert(bo->getOpcode() == Instruction::Xor);
+    BinaryOperator *op,*op1 = NULL;
+    op = BinaryOperator::CreateNot(bo->getOperand(0), "", bo);
+    op = BinaryOperator::Create(Instruction::And, bo->getOperand(1), op, "", bo);
+    op1 = BinaryOperator::CreateNot(bo->getOperand(1), "", bo);
+    op1 = BinaryOperator::Create(Instruction::And, bo->getOperand(0), op1, "", bo);
+    op = BinaryOperator::Create(Instruction::Or, op, op1, "", bo);
+    bo->replaceAllUsesWith(op);
+  }
+
+  /* constant-initialized, nothing to build per pass; dispatch is an indexed call */
+  const Rewrite addBox[] = {addNeg, addDoubleNeg, addRand};
+  const Rewrite subBox[] = {subNeg, subSwap};
+  const Rewrite andBox[] = {andSwap, andXorNot};
+  const Rewrite  orBox[] = {orSwap, orAndXor};
+  const Rewrite xorBox[] = {xorSwap, xorAndNot};
+
+  /*
+   * Added by the builder hooks below next to the late instance; it only marks
+   * that pipeline, so an earlier instance in it can tell and step aside.
+   * Other pipelines, and drivers that build their own, never see it.
+   */
+  struct SubstitutionScheduledLate : public ImmutablePass {
+    static char ID;
+    SubstitutionScheduledLate() : ImmutablePass(ID) {}
+  };
+
   struct Substitution : public FunctionPass {
     static char ID;
     bool flag;
+    bool late;
+    CryptoUtils crypto;
+
+    /* per function: target costs, and one cheap constant per type */
+    const TargetTransformInfo *TTI;
+    DenseMap<Type *, Constant *> constants;
+    OptimizationRemarkEmitter *ORE;
+    SmallPtrSet<Instruction *, 32> exempt;
 
-    vector<function<void(BinaryOperator *bo)>> addBox;
-    vector<function<void(BinaryOperator *bo)>> subBox;
-    vector<function<void(BinaryOperator *bo)>> andBox;
-    vector<function<void(BinaryOperator *bo)>>  orBox;
-    vector<function<void(BinaryOperator *bo)>> xorBox;
-
-    Substitution() : FunctionPass(ID) {this->flag = true, initBox();}
-    Substitution(bool flag) : Substitution() {this->flag = flag, initBox();}
-
-    void initBox() {
-      addBox = {
-        /* a + b = a - (-b) */
-        [](BinaryOperator *bo){
-          assert(bo->getOpcode() == Instruction::Add);
-          BinaryOperator *op = NULL;
-          op = BinaryOperator::CreateNeg(bo->getOperand(1), "", bo);
-          op = BinaryOperator::Create(Instruction::Sub, bo->getOperand(0), op, "", bo);
-          bo->replaceAllUsesWith(op);
-        },
-        /* a + b = -(-a + (-b)) */
-        [](BinaryOperator *bo){
-          assert(bo->getOpcode() == Instruction::Add);
-          BinaryOperator *op, *op2 = NULL;
-          op = BinaryOperator::CreateNeg(bo->getOperand(0), "", bo);
-          op2 = BinaryOperator::CreateNeg(bo->getOperand(1), "", bo);
-          op = BinaryOperator::Create(Instruction::Add, op, op2, "", bo);
-          op = BinaryOperator::CreateNeg(op, "", bo);
-          bo->replaceAllUsesWith(op);
-        },
-        /* a + b = a - r + b + r */
-        [](BinaryOperator *bo){
-          assert(bo->getOpcode() == Instruction::Add);
-          BinaryOperator *op = NULL;
-          Type *ty = bo->getType();
-          ConstantInt *co = (ConstantInt*)ConstantInt::get(ty, llvm::cryptoutils->get_range(INT32_MAX));
-          op = BinaryOperator::Create(Instruction::Sub, bo->getOperand(0), co, "", bo);
-          op = BinaryOperator::Create(Instruction::Add, op, bo->getOperand(1), "", bo);
-          op = BinaryOperator::Create(Instruction::Add, op, co, "", bo);
-          bo->replaceAllUsesWith(op);
-        },
-      };
-
-      subBox = {
-        /* a - b = a + (-b) */
-        [](BinaryOperator *bo){
-          assert(bo->getOpcode() == Instruction::Sub);
-          BinaryOperator *op = NULL;
-          op = BinaryOperator::CreateNeg(bo->getOperand(1), "", bo);
-          op = BinaryOperator::Create(Instruction::Add, bo->getOperand(0), op, "", bo);
-          bo->replaceAllUsesWith(op);
-        },
-        /* a - b = -(b - a) */
-        [](BinaryOperator *bo){
-          assert(bo->getOpcode() == Instruction::Sub);
-          BinaryOperator *op = NULL;
-          op = BinaryOperator::Create(Instruction::Sub, bo->getOperand(1), bo->getOperand(0), "", bo);
-          op = BinaryOperator::CreateNeg(op, "", bo);
-          bo->replaceAllUsesWith(op);
-        },
-      };
-
-      andBox = {
-        /* a & b = b & a */
-        [](BinaryOperator *bo){
-          assert(bo->getOpcode() == Instruction::And);
-          BinaryOperator *op = NULL;
-          op = BinaryOperator::Create(Instruction::And, bo->getOperand(1), bo->getOperand(0), "", bo);
-          bo->replaceAllUsesWith(op);
-        },
-        /* a & b == (a^~b) & a */
-        [](BinaryOperator *bo){
-          assert(bo->getOpcode() == Instruction::And);
-          BinaryOperator *op, *op2 = NULL;
-          op = BinaryOperator::CreateNot(bo->getOperand(1), "", bo);
-          op2 = BinaryOperator::Create(Instruction::Xor, bo->getOperand(0), op, "", bo);
-          op = BinaryOperator::Create(Instruction::And, op2, bo->getOperand(0), "", bo);
-          bo->replaceAllUsesWith(op);
-        },
-      };
-
-      orBox = {
-        /* a | b = b | a */
-        [](BinaryOperator *bo){
-          assert(bo->getOpcode() == Instruction::Or);
-          BinaryOperator *op = NULL;
-          op = BinaryOperator::Create(Instruction::Or, bo->getOperand(1), bo->getOperand(0), "", bo);
-          bo->replaceAllUsesWith(op);
-        },
-        /* a | b = (a & b) | (a ^ b) */
-        [](BinaryOperator *bo){
-          assert(bo->getOpcode() == Instruction::Or);
-          BinaryOperator *op, *op1 = NULL;
-          op = BinaryOperator::Create(Instruction::And, bo->getOperand(0), bo->getOperand(1), "", bo);
-          op1 = BinaryOperator::Create(Instruction::Xor, bo->getOperand(0), bo->getOperand(1), "", bo);
-          op = BinaryOperator::Create(Instruction::Or, op, op1, "", bo);
-          bo->replaceAllUsesWith(op);
-        },
-      };
-
-      xorBox = {
-        /* a ^ b = b ^ a */
-        [](BinaryOperator *bo){
-          assert(bo->getOpcode() == Instruction::Xor);
-          BinaryOperator *op = NULL;
-          op = BinaryOperator::Create(Instruction::Xor, bo->getOperand(1), bo->getOperand(0), "", bo);
-          bo->replaceAllUsesWith(op);
-        },
-        /* a ~ b => a = (!a && b) | (a && !b) */
-        [](BinaryOperator *bo){
-          assert(bo->getOpcode() == Instruction::Xor);
-          BinaryOperator *op,*op1 = NULL;
-          op = BinaryOperator::CreateNot(bo->getOperand(0), "", bo);
-          op = BinaryOperator::Create(Instruction::And, bo->getOperand(1), op, "", bo);
-          op1 = BinaryOperator::CreateNot(bo->getOperand(1), "", bo);
-          op1 = BinaryOperator::Create(Instruction::And, bo->getOperand(0), op1, "", bo);
-          op = BinaryOperator::Create(Instruction::Or, op, op1, "", bo);
-          bo->replaceAllUsesWith(op);
-        },
-      };
+    Substitution() : FunctionPass(ID), TTI(NULL), ORE(NULL) {this->flag = true; this->late = false;}
+    Substitution(bool flag) : FunctionPass(ID), TTI(NULL), ORE(NULL) {this->flag = flag; this->late = false;}
+    Substitution(bool flag, bool late) : FunctionPass(ID), TTI(NULL), ORE(NULL) {this->flag = flag; this->late = late;}
+
+    bool isFreeImm(const APInt &imm, Type *ty) {
+      if (!TTI)
+        return imm.isIntN(8);
+      return TTI->getIntImmCost(Instruction::Add, 1, imm, ty) == TargetTransformInfo::TCC_Free;
+    }
+
+    /*
+     * A random r that folds into the add/sub immediate field, so a - r + b + r
+     * costs two ALU ops and no materialization; wide draws first, narrowing
+     * until the target takes one. Shared by every site of the function.
+     * Vector types get a splat.
+     */
+    Constant *cheapConstant(Type *ty) {
+      Constant *&co = constants[ty];
+      if (co)
+        return co;
+
+      IntegerType *sty = cast<IntegerType>(ty->getScalarType());
+      unsigned bits = sty->getBitWidth();
+      APInt imm(bits, 1);
+      for (unsigned width : {32u, 16u, 12u, 8u}) {
+        bool found = false;
+        for (unsigned tries = 0; tries < 4 && !found; tries++) {
+          APInt r(bits, crypto.get_uint64_t() & maskTrailingOnes<uint64_t>(std::min(width, bits)));
+          if (r.isNullValue())
+            continue;
+          imm = r;
+          found = isFreeImm(imm, sty);
+        }
+        if (found)
+          break;
+      }
+      co = ConstantInt::get(ty, imm);
+      return co;
+    }
+
+    /* cost is the instructions the rewrite put in front of bo, less bo itself */
+    template <size_t N>
+    void apply(const Rewrite (&box)[N], BinaryOperator *bo) {
+      Instruction *prev = bo->getPrevNode();
+      unsigned idx = crypto.choose(N);
+      box[idx](this, bo);
+
+      unsigned cost = 0;
+      for (Instruction *I = prev ? prev->getNextNode() : &bo->getParent()->front(); I != bo;
+           I = I->getNextNode())
+        cost++;
+      ORE->emit([&]() {
+        return OptimizationRemark(DEBUG_TYPE, "Substituted", bo)
+               << "substituted " << ore::NV("Opcode", bo->getOpcodeName())
+               << " with box " << ore::NV("Box", idx)
+               << ", cost " << ore::NV("Cost", cost - 1);
+      });
     }
 
     bool checkParams() {
-      if (sub_time <= 0) {
+      if (subOptions().rounds <= 0) {
         errs() << "-sub_loop=x must be x > 0";
         return false;
       }
-      if (sub_rate > 100) {
+      if (subOptions().rate > 100) {
         errs() << "-sub_prob=x must be 0 < x <= 100";
         return false;
       }
@@ -165,8 +264,26 @@ namespace {
       if (!checkParams())
         return false;
 
-      if (Morphling::toObfuscate(flag, &F, "sub")) {
+      /* the late instance of this pipeline stands in for this one */
+      if (!late && getResolver() && getAnalysisIfAvailable<SubstitutionScheduledLate>())
+        return false;
+
+      /* already rewritten by an instance of another pipeline */
+      if (F.hasFnAttribute("morphling-sub"))
+        return false;
+
+      bool enabled = late ? subOptions().all : flag;
+      if (Morphling::toObfuscate(enabled, &F, "sub")) {
+        TTI = NULL;
+        if (getResolver())
+          if (auto *TTIP = getAnalysisIfAvailable<TargetTransformInfoWrapperPass>())
+            TTI = &TTIP->getTTI(F);
+        constants.clear();
+        OptimizationRemarkEmitter emitter(&F);
+        ORE = &emitter;
         substitute(F);
+        ORE = NULL;
+        F.addFnAttr("morphling-sub");
         return true;
       }
       return false;
@@ -176,19 +293,19 @@ namespace {
       BinaryOperator* bo = cast<BinaryOperator>(inst);
       switch (inst->getOpcode()) {
         case BinaryOperator::Add:
-          addBox.at(llvm::cryptoutils->get_range(INT16_MAX) % addBox.size())(bo);
+          apply(addBox, bo);
           break;
         case BinaryOperator::Sub:
-          subBox.at(llvm::cryptoutils->get_range(INT16_MAX) % subBox.size())(bo);
+          apply(subBox, bo);
           break;
         case Instruction::And:
-          andBox.at(llvm::cryptoutils->get_range(INT16_MAX) % andBox.size())(bo);
+          apply(andBox, bo);
           break;
         case Instruction::Or:
-          orBox.at(llvm::cryptoutils->get_range(INT16_MAX) % orBox.size())(bo);
+          apply(orBox, bo);
           break;
         case Instruction::Xor:
-          xorBox.at(llvm::cryptoutils->get_range(INT16_MAX) % xorBox.size())(bo);
+          apply(xorBox, bo);
           break;
         default:
           return false;
@@ -196,24 +313,92 @@ namespace {
       return true;
     }
 
+    /* every rewrite is lane-uniform, so integer vectors keep their width */
+    bool isCandidate(Instruction & inst) {
+      return inst.isBinaryOp() && inst.getType()->isIntOrIntVectorTy();
+    }
+
     bool shouldSubstitute(Instruction & inst) {
-      return inst.isBinaryOp() && (cryptoutils->get_range(100) <= sub_rate);
+      return isCandidate(inst) && !exempt.count(&inst) && crypto.get_bool(subOptions().rate);
     }
 
+    /*
+     * sites are the operators the function had on entry, in order, leaving
+     * out what the passes before this one added at random
+     */
     bool substitute(Function &f) {
-      int n = sub_time;
+      exempt.clear();
+      DenseMap<Instruction *, uint64_t> sites;
+      unsigned ordinal = 0;
+      for (Instruction &inst : instructions(f)) {
+        if (!isCandidate(inst) || Morphling::isGenerated(&inst))
+          continue;
+        uint64_t site = Morphling::siteId(f, DEBUG_TYPE, ordinal++);
+        if (Morphling::isHotSite(site))
+          exempt.insert(&inst);
+        else
+          sites[&inst] = site;
+      }
+
+      bool counting = Morphling::shouldCountSites();
+      SmallVector<GlobalValue *, 16> counters;
+      int n = subOptions().rounds;
       while (n--) {
         for (Function::iterator bb = f.begin(); bb != f.end(); ++bb)
           for (BasicBlock::iterator inst = bb->begin(); inst != bb->end(); ++inst)
-            if (shouldSubstitute(*inst))
-              resolve(&*inst);
+            if (shouldSubstitute(*inst) && resolve(&*inst) && counting) {
+              auto site = sites.find(&*inst);
+              if (site != sites.end()) {
+                counters.push_back(Morphling::countSite(&*inst, site->second));
+                sites.erase(site);
+              }
+            }
       }
+      if (!counters.empty())
+        appendToUsed(*f.getParent(), counters);
       return false;
     }
   };
+
+  void addRand(Substitution *pass, BinaryOperator *bo) {
+    assert(bo->getOpcode() == Instruction::Add);
+    BinaryOperator *op = NULL;
+    Constant *co = pass->cheapConstant(bo->getType());
+    op = BinaryOperator::Create(Instruction::Sub, bo->getOperand(0), co, "", bo);
+    op = BinaryOperator::Create(Instruction::Add, op, bo->getOperand(1), "", bo);
+    op = BinaryOperator::Create(Instruction::Add, op, co, "", bo);
+    bo->replaceAllUsesWith(op);
+  }
 }
 
 char Substitution::ID = 0;
 INITIALIZE_PASS(Substitution, "subobf", "Enable Instruction Substitution.", true, true)
 FunctionPass *llvm::createSubstitutionPass() { return new Substitution(); }
 FunctionPass *llvm::createSubstitutionPass(bool flag) {return new Substitution(flag);}
+
+char SubstitutionScheduledLate::ID = 0;
+static RegisterPass<SubstitutionScheduledLate>
+RegisterScheduledLate("subobf-late", "Substitution scheduled after the vectorizers", false, true);
+
+/*
+ * Rewritten arithmetic no longer matches the loop and SLP vectorizers'
+ * reduction and idiom patterns, so substitution runs once they are done and
+ * rewrites whole vectors with splat constants. Functions are still opted in
+ * or out by annotation; obfuscation.subobf, read at the first function and
+ * not while the pipeline is built, turns it on for all of them. An instance
+ * from createSubstitutionPass in the same pipeline steps aside, so no function
+ * is substituted twice; the decision is made per pipeline as it is built.
+ */
+static void addSubstitutionPass(const PassManagerBuilder &Builder,
+                                legacy::PassManagerBase &PM) {
+  if (!sub_late)
+    return;
+  PM.add(new SubstitutionScheduledLate());
+  PM.add(new Substitution(true, true));
+}
+
+static RegisterStandardPasses
+RegisterSubstitution(PassManagerBuilder::EP_OptimizerLast, addSubstitutionPass);
+
+static RegisterStandardPasses
+RegisterSubstitutionO0(PassManagerBuilder::EP_EnabledOnOptLevel0, addSubstitutionPass);
@@ -0,0 +1,165 @@
+//===----------------------------------------------------------------------------------===//
+// TsukiOpt: obfuscate many bitcode files in place, on every core
+//
+//   TsukiOpt [-j N] [-strcry] [-filelist list] file.bc ...
+//
+// The config is fetched from the center once for the whole batch, instead of
+// once per clang/ld invocation. Each file is a task on a thread pool with an
+// LLVMContext of its own; Morphling and Substitution run as they would in the
+// compiler (and LTOMorphling with -strcry), and the result replaces the input
+// through a temporary file and a rename, so a failed file is left untouched.
+// The usual -mh_* / sub_* / strcry_* options apply to every file.
+//===----------------------------------------------------------------------------------===//
+
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/InitializePasses.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/PrettyStackTrace.h"
+#include "llvm/Support/Signals.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Obfuscation/Morphling.h"
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+using namespace std;
+
+static cl::list<std::string> InputFiles(cl::Positional, cl::ZeroOrMore,
+                                        cl::desc("<bitcode files>"));
+
+static cl::opt<std::string> FileList("filelist",
+                                     cl::init(""),
+                                     cl::desc("file with one bitcode path per line"));
+
+static cl::opt<unsigned> Jobs("j",
+                              cl::init(0),
+                              cl::desc("worker threads (0: one per core)"));
+
+static cl::opt<bool> StrCry("strcry",
+                            cl::init(false),
+                            cl::desc("also encrypt strings, as LTOMorphling does at link time"));
+
+static std::mutex outputLock;
+
+static bool fail(StringRef path, const Twine &message) {
+  std::lock_guard<std::mutex> guard(outputLock);
+  errs() << "TsukiOpt: " << path << ": " << message << "\n";
+  return false;
+}
+
+static bool loadFileList(StringRef path, std::vector<std::string> &files) {
+  ErrorOr<std::unique_ptr<MemoryBuffer>> buffer = MemoryBuffer::getFile(path);
+  if (!buffer)
+    return fail(path, buffer.getError().message());
+  SmallVector<StringRef, 0> lines;
+  (*buffer)->getBuffer().split(lines, '\n', -1, false);
+  for (StringRef line : lines)
+    if (!line.trim().empty())
+      files.push_back(line.trim());
+  return true;
+}
+
+/* written next to the input, so the rename never crosses file systems */
+static bool writeInPlace(StringRef path, Module &M) {
+  int fd;
+  SmallString<128> temp;
+  if (std::error_code ec = sys::fs::createUniqueFile(path + ".tsuki-%%%%%%", fd, temp))
+    return fail(path, ec.message());
+
+  raw_fd_ostream os(fd, true);
+  WriteBitcodeToFile(&M, os);
+  os.close();
+  if (os.has_error()) {
+    os.clear_error();
+    sys::fs::remove(temp);
+    return fail(path, "cannot write " + temp.str());
+  }
+
+  if (std::error_code ec = sys::fs::rename(temp, path)) {
+    sys::fs::remove(temp);
+    return fail(path, ec.message());
+  }
+  return true;
+}
+
+static bool obfuscate(StringRef path, bool substitute) {
+  LLVMContext context;
+  SMDiagnostic diag;
+  std::unique_ptr<Module> M = parseIRFile(path, diag, context);
+  if (!M)
+    return fail(path, diag.getMessage());
+
+  legacy::PassManager PM;
+  PM.add(createMorphlingPass());
+  PM.add(createSubstitutionPass(substitute));
+  if (StrCry)
+    PM.add(createLTOMorphlingPass());
+  PM.run(*M);
+
+  std::string errors;
+  raw_string_ostream es(errors);
+  if (verifyModule(*M, &es))
+    return fail(path, "broken module after obfuscation:\n" + es.str());
+
+  return writeInPlace(path, *M);
+}
+
+int main(int argc, char **argv) {
+  sys::PrintStackTraceOnErrorSignal(argv[0]);
+  PrettyStackTraceProgram X(argc, argv);
+  llvm_shutdown_obj Y;
+
+  PassRegistry &Registry = *PassRegistry::getPassRegistry();
+  initializeCore(Registry);
+  initializeAnalysis(Registry);
+  initializeMorphlingPass(Registry);
+
+  cl::ParseCommandLineOptions(argc, argv, "batch obfuscation of bitcode files\n");
+
+  std::vector<std::string> files(InputFiles.begin(), InputFiles.end());
+  if (!FileList.empty() && !loadFileList(FileList, files))
+    return 1;
+  if (files.empty()) {
+    errs() << "TsukiOpt: no input files\n";
+    return 1;
+  }
+
+  /* one round trip for the whole batch; the workers only read the cache */
+  if (!Morphling::centerIsAlive()) {
+    errs() << "TsukiOpt: morphling is not alive!\n";
+    return 1;
+  }
+  bool substitute = Morphling::getConfig("obfuscation.subobf").IsObject();
+
+  unsigned jobs = Jobs ? Jobs : heavyweight_hardware_concurrency();
+  std::atomic<unsigned> failed(0);
+  {
+    ThreadPool pool(std::min<size_t>(jobs, files.size()));
+    for (const std::string &path : files)
+      pool.async([&failed, &path, substitute] {
+        if (!obfuscate(path, substitute))
+          failed++;
+      });
+    pool.wait();
+  }
+
+  if (failed) {
+    errs() << "TsukiOpt: " << failed.load() << " of " << files.size() << " files failed\n";
+    return 1;
+  }
+  return 0;
+}